@@ -0,0 +1,281 @@
+// Benchmarks for the autograd layer in gradtensor.hpp, on Google Benchmark:
+//
+//   g++ -std=c++17 -O2 -pthread bench.cpp -lbenchmark -o bench
+//   ./bench --benchmark_filter=Chain
+//
+// Add -DGRADTENSOR_USE_CBLAS -lopenblas to time the BLAS gemm path. Every
+// benchmark reports the peak RSS reached while it ran, so memory
+// regressions show up next to the timings.
+#include "driver.hpp"
+
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+// ===================== Helpers =====================
+// The process's peak RSS only ever grows, so each benchmark starts by
+// emptying the buffer pool and resetting the kernel's high-water mark to
+// the current RSS (writing 5 to clear_refs). Kernels without that reset
+// leave the whole-process peak in VmHWM, and non-Linux systems fall back
+// to getrusage, which is whole-process too.
+void resetPeakRss() {
+    bufferPool<xt::xarray<double>>::clear();
+    ofstream("/proc/self/clear_refs") << "5";
+}
+
+void reportPeakRss(benchmark::State& state) {
+    double kib = 0.0;
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            kib = stod(line.substr(6));
+            break;
+        }
+    }
+    if (kib == 0.0) {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        // ru_maxrss is in KiB on Linux.
+        kib = double(usage.ru_maxrss);
+    }
+    state.counters["peakRssMiB"] = kib / 1024.0;
+}
+
+// ===================== Graph Shape =====================
+// A chain of depth multiply-adds on small tensors: graph overhead per op
+// dominates the kernels.
+tensor chain(const tensor& x, const tensor& w, const tensor& b, int64_t depth) {
+    tensor h = x;
+    for (int64_t i = 0; i < depth; ++i) {
+        h = h * w + b;
+    }
+    return h;
+}
+
+void chainForward(benchmark::State& state) {
+    resetPeakRss();
+    const int64_t depth = state.range(0);
+    auto x = filled({16}, 1.0);
+    auto w = filled({16}, 0.999);
+    auto b = filled({16}, 0.001);
+    for (auto _ : state) {
+        noGradGuard guard;
+        benchmark::DoNotOptimize(chain(x, w, b, depth));
+    }
+    state.SetItemsProcessed(state.iterations() * depth * 2);
+    reportPeakRss(state);
+}
+BENCHMARK(chainForward)->RangeMultiplier(16)->Range(1, 1 << 16);
+
+void chainForwardBackward(benchmark::State& state) {
+    resetPeakRss();
+    const int64_t depth = state.range(0);
+    auto x = filled({16}, 1.0);
+    auto w = filled({16}, 0.999);
+    auto b = filled({16}, 0.001);
+    for (auto _ : state) {
+        chain(x, w, b, depth)->backward();
+    }
+    state.SetItemsProcessed(state.iterations() * depth * 2);
+    reportPeakRss(state);
+}
+BENCHMARK(chainForwardBackward)->RangeMultiplier(16)->Range(1, 1 << 16);
+
+// The same chain with its graph objects in an arena.
+void chainForwardBackwardArena(benchmark::State& state) {
+    resetPeakRss();
+    const int64_t depth = state.range(0);
+    auto x = filled({16}, 1.0);
+    auto w = filled({16}, 0.999);
+    auto b = filled({16}, 0.001);
+    graphArena arena;
+    for (auto _ : state) {
+        {
+            arenaScope scope(arena);
+            chain(x, w, b, depth)->backward();
+        }
+        arena.reset();
+    }
+    state.SetItemsProcessed(state.iterations() * depth * 2);
+    reportPeakRss(state);
+}
+BENCHMARK(chainForwardBackwardArena)->RangeMultiplier(16)->Range(1, 1 << 16);
+
+// Recorded once, then replayed from the tape each iteration.
+void chainTapeReplay(benchmark::State& state) {
+    resetPeakRss();
+    const int64_t depth = state.range(0);
+    auto x = filled({16}, 1.0);
+    auto w = filled({16}, 0.999);
+    auto b = filled({16}, 0.001);
+    gradTape<double> tape;
+    tensor out;
+    {
+        tapeCapture<double> capture(tape);
+        out = chain(x, w, b, depth);
+    }
+    tape.finalize(out);
+    for (auto _ : state) {
+        tape.replay();
+    }
+    state.SetItemsProcessed(state.iterations() * depth * 2);
+    reportPeakRss(state);
+}
+BENCHMARK(chainTapeReplay)->RangeMultiplier(16)->Range(1, 1 << 16);
+
+// width branches off one input, summed pairwise back into one: every
+// branch is a diamond through x.
+void diamondFanOut(benchmark::State& state) {
+    resetPeakRss();
+    const int64_t width = state.range(0);
+    auto x = filled({64}, 1.0);
+    vector<tensor> weights;
+    for (int64_t i = 0; i < width; ++i) {
+        weights.push_back(filled({64}, 1.0 + 1e-3 * double(i)));
+    }
+    for (auto _ : state) {
+        vector<tensor> level;
+        for (const auto& w : weights) {
+            level.push_back(x * w);
+        }
+        while (level.size() > 1) {
+            vector<tensor> next;
+            for (size_t i = 0; i + 1 < level.size(); i += 2) {
+                next.push_back(level[i] + level[i + 1]);
+            }
+            if (level.size() % 2) {
+                next.push_back(level.back());
+            }
+            level = move(next);
+        }
+        level[0]->backward();
+    }
+    state.SetItemsProcessed(state.iterations() * (2 * width - 1));
+    reportPeakRss(state);
+}
+BENCHMARK(diamondFanOut)->RangeMultiplier(8)->Range(2, 1 << 12);
+
+// Scalar graphs, with and without the gradScalar fast path.
+void scalarChainTensor(benchmark::State& state) {
+    resetPeakRss();
+    const int64_t depth = state.range(0);
+    auto w = filled({}, 0.999);
+    for (auto _ : state) {
+        tensor h = filled({}, 1.0);
+        for (int64_t i = 0; i < depth; ++i) {
+            h = h * w;
+        }
+        h->backward();
+    }
+    state.SetItemsProcessed(state.iterations() * depth);
+    reportPeakRss(state);
+}
+BENCHMARK(scalarChainTensor)->Arg(1024);
+
+void scalarChainGradScalar(benchmark::State& state) {
+    resetPeakRss();
+    const int64_t depth = state.range(0);
+    auto w = make_shared<gradScalar<double>>(0.999);
+    for (auto _ : state) {
+        auto h = make_shared<gradScalar<double>>(1.0);
+        for (int64_t i = 0; i < depth; ++i) {
+            h = h * w;
+        }
+        h->backward();
+    }
+    state.SetItemsProcessed(state.iterations() * depth);
+    reportPeakRss(state);
+}
+BENCHMARK(scalarChainGradScalar)->Arg(1024);
+
+// ===================== Tensor Size =====================
+// One multiply and its backward from single elements up to 10M, where the
+// kernels and memory bandwidth dominate.
+void sizeSweep(benchmark::State& state) {
+    resetPeakRss();
+    const size_t n = size_t(state.range(0));
+    auto a = filled({n}, 1.5);
+    auto b = filled({n}, 0.5);
+    for (auto _ : state) {
+        (a * b)->backward();
+    }
+    // Forward reads two operands and writes one; backward reads the seed
+    // and both operands and writes two gradients.
+    state.SetBytesProcessed(state.iterations() * int64_t(n * sizeof(double)) * 8);
+    reportPeakRss(state);
+}
+BENCHMARK(sizeSweep)->RangeMultiplier(10)->Range(1, 10000000);
+
+// ===================== Op Mix =====================
+// Forward plus backward of each op on [n, n] operands.
+template <class Op>
+void opBenchmark(benchmark::State& state, Op op) {
+    resetPeakRss();
+    const size_t n = size_t(state.range(0));
+    auto a = filled({n, n}, 0.5);
+    auto b = filled({n, n}, 1.5);
+    for (auto _ : state) {
+        op(a, b)->backward();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(n * n));
+    reportPeakRss(state);
+}
+
+BENCHMARK_CAPTURE(opBenchmark, add, [](const tensor& a, const tensor& b) { return a + b; })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, sub, [](const tensor& a, const tensor& b) { return a - b; })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, mul, [](const tensor& a, const tensor& b) { return a * b; })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, div, [](const tensor& a, const tensor& b) { return a / b; })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, matmul, [](const tensor& a, const tensor& b) {
+    return matmul(a, b);
+})->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, relu, [](const tensor& a, const tensor&) { return relu(a); })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, tanh, [](const tensor& a, const tensor&) { return tanh(a); })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, sigmoid, [](const tensor& a, const tensor&) { return sigmoid(a); })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, exp, [](const tensor& a, const tensor&) { return exp(a); })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, log, [](const tensor& a, const tensor&) { return log(a); })
+    ->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(opBenchmark, softmaxCrossEntropy, [](const tensor& a, const tensor& b) {
+    return softmaxCrossEntropy(a, b);
+})->RangeMultiplier(4)->Range(16, 1024);
+
+// [n, n] + [n]: the row is broadcast forward and reduced backward.
+void broadcastAdd(benchmark::State& state) {
+    resetPeakRss();
+    const size_t n = size_t(state.range(0));
+    auto a = filled({n, n}, 0.5);
+    auto row = filled({n}, 1.5);
+    for (auto _ : state) {
+        (a + row)->backward();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(n * n));
+    reportPeakRss(state);
+}
+BENCHMARK(broadcastAdd)->RangeMultiplier(4)->Range(16, 1024);
+
+// A fused linear layer against the same layer built from matmul and +.
+void linearLayer(benchmark::State& state, bool fused) {
+    resetPeakRss();
+    const size_t n = size_t(state.range(0));
+    auto x = filled({n, n}, 0.5);
+    auto w = filled({n, n}, 0.01);
+    auto b = filled({n}, 0.1);
+    for (auto _ : state) {
+        (fused ? linear(x, w, b) : matmul(x, w) + b)->backward();
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(n * n));
+    reportPeakRss(state);
+}
+BENCHMARK_CAPTURE(linearLayer, fused, true)->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK_CAPTURE(linearLayer, composed, false)->RangeMultiplier(4)->Range(16, 1024);
+
+BENCHMARK_MAIN();
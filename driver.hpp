@@ -0,0 +1,17 @@
+// Helpers shared by the drivers built beside gradtensor.hpp: bench.cpp,
+// stress.cpp and serialcheck.cpp.
+#ifndef GRADTENSOR_DRIVER_HPP
+#define GRADTENSOR_DRIVER_HPP
+
+#include "gradtensor.hpp"
+
+using tensor = std::shared_ptr<gradTensor<double>>;
+
+// A leaf of the given shape with every element set to value.
+inline tensor filled(std::vector<size_t> shape, double value) {
+    xt::xarray<double> data = xt::xarray<double>::from_shape(shape);
+    data.fill(value);
+    return std::make_shared<gradTensor<double>>(std::move(data));
+}
+
+#endif
@@ -0,0 +1,4667 @@
+#ifndef GRADTENSOR_HPP
+#define GRADTENSOR_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "xtensor/xadapt.hpp"
+#include "xtensor/xarray.hpp"
+#include "xtensor/xfixed.hpp"
+#include "xtensor/xio.hpp"
+#include "xtensor/xmath.hpp"
+#include "xtensor/xnoalias.hpp"
+#include "xtensor/xtensor.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef GRADTENSOR_USE_CBLAS
+#include <cblas.h>
+#endif
+
+#ifdef GRADTENSOR_PROFILE
+#include <chrono>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <iomanip>
+#include <map>
+#include <typeindex>
+#include <typeinfo>
+#endif
+
+// ===================== Containers =====================
+// gradTensor keeps its values and gradients in an xtensor container C:
+// xt::xarray<T> (the default) for dynamic rank, xt::xtensor<T, N> for a
+// rank fixed at compile time with the shape held inline, or
+// xt::xtensor_fixed<T, xt::xshape<...>> for a shape fixed at compile time
+// with stack storage. Operands of one op share C, so for fixed shapes the
+// shape checks fold away at compile time.
+template <class C>
+struct isFixedContainer : std::false_type {};
+
+template <class ET, class S, xt::layout_type L, bool SH, class Tag>
+struct isFixedContainer<xt::xfixed_container<ET, S, L, SH, Tag>> : std::true_type {};
+
+// Shapes of rank-fixed containers are std::arrays and cannot change rank.
+template <class S>
+bool resizeShape(S& shape, size_t rank) {
+    shape.resize(rank);
+    return true;
+}
+
+template <size_t N>
+bool resizeShape(std::array<size_t, N>&, size_t rank) {
+    return rank == N;
+}
+
+// ===================== Reduced Precision =====================
+// bfloat16 storage: the upper half of an IEEE float, rounded to nearest
+// even. It converts to and from float implicitly, so every elementwise
+// operation computes in fp32 and only its stored result is rounded. Kernels
+// that sum over many elements accumulate in accumulatorType<T>.
+struct bfloat16 {
+    uint16_t bits = 0;
+
+    bfloat16() = default;
+    bfloat16(float f) {
+        uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        if ((u & 0x7fffffffu) > 0x7f800000u) {
+            // Keep NaNs quiet instead of letting rounding carry into inf.
+            bits = uint16_t((u >> 16) | 0x40u);
+            return;
+        }
+        u += 0x7fffu + ((u >> 16) & 1u);
+        bits = uint16_t(u >> 16);
+    }
+
+    operator float() const {
+        uint32_t u = uint32_t(bits) << 16;
+        float f;
+        std::memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+
+    bfloat16& operator+=(float x) { return *this = float(*this) + x; }
+    bfloat16& operator-=(float x) { return *this = float(*this) - x; }
+    bfloat16& operator*=(float x) { return *this = float(*this) * x; }
+    bfloat16& operator/=(float x) { return *this = float(*this) / x; }
+};
+
+inline std::ostream& operator<<(std::ostream& os, bfloat16 x) { return os << float(x); }
+
+template <typename T>
+struct accumulatorType {
+    using type = T;
+};
+
+template <>
+struct accumulatorType<bfloat16> {
+    using type = float;
+};
+
+template <typename T, class C = xt::xarray<T>>
+class gradTensor;
+
+template <typename T, class C = xt::xarray<T>>
+class gradNode;
+
+template <typename T, class C = xt::xarray<T>>
+class backwardEngine;
+
+template <typename T, class C = xt::xarray<T>>
+class batchPass;
+
+template <typename T, class C = xt::xarray<T>>
+class gradTape;
+
+// ===================== Grad Mode =====================
+// Per-thread switch for graph recording. While it is off, the operators
+// build plain result tensors with no source, so the operands are released
+// as soon as the caller drops them.
+class gradMode {
+public:
+    static bool isEnabled() { return enabled(); }
+    static void setEnabled(bool on) { enabled() = on; }
+
+private:
+    static bool& enabled() {
+        static thread_local bool flag = true;
+        return flag;
+    }
+};
+
+// Disables graph recording on the current thread for its lifetime.
+class noGradGuard {
+    bool previous;
+public:
+    noGradGuard() : previous(gradMode::isEnabled()) { gradMode::setEnabled(false); }
+    ~noGradGuard() { gradMode::setEnabled(previous); }
+
+    noGradGuard(const noGradGuard&) = delete;
+    noGradGuard& operator=(const noGradGuard&) = delete;
+};
+
+// Enables it again, e.g. to rebuild part of a graph during backward.
+class enableGradGuard {
+    bool previous;
+public:
+    enableGradGuard() : previous(gradMode::isEnabled()) { gradMode::setEnabled(true); }
+    ~enableGradGuard() { gradMode::setEnabled(previous); }
+
+    enableGradGuard(const enableGradGuard&) = delete;
+    enableGradGuard& operator=(const enableGradGuard&) = delete;
+};
+
+// ===================== Graph Arena =====================
+// Bump allocator for the nodes and backops of one forward/backward
+// iteration. While an arenaScope is active on a thread, the operators
+// place each result tensor, its gradNode and its backop (together with
+// their shared_ptr control blocks and the backop's edge list) in the arena
+// instead of on the heap. reset() rewinds to the first block but keeps
+// every block, so a loop that rebuilds the same graph shape reaches a
+// steady state with no per-op heap calls. An arena is filled by one thread
+// at a time and must outlive every object in it. Objects may be released
+// from any thread, as the parallel backward does, so only the count of
+// live objects is shared.
+class graphArena {
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<size_t> blockSizes;
+    size_t blockSize;
+    size_t current = 0;
+    size_t offset = 0;
+    std::atomic<size_t> live{0};
+
+    void addBlock(size_t bytes) {
+        blocks.emplace_back(new char[bytes]);
+        blockSizes.push_back(bytes);
+    }
+
+public:
+    explicit graphArena(size_t blockBytes = size_t(1) << 16) : blockSize(blockBytes) {
+        addBlock(blockSize);
+    }
+
+    graphArena(const graphArena&) = delete;
+    graphArena& operator=(const graphArena&) = delete;
+
+    void* allocate(size_t bytes, size_t align) {
+        while (true) {
+            void* ptr = blocks[current].get() + offset;
+            size_t space = blockSizes[current] - offset;
+            if (std::align(align, bytes, ptr, space)) {
+                offset = blockSizes[current] - space + bytes;
+                live.fetch_add(1, std::memory_order_relaxed);
+                return ptr;
+            }
+            if (current + 1 == blocks.size()) {
+                addBlock(std::max(blockSize, bytes + align));
+            }
+            ++current;
+            offset = 0;
+        }
+    }
+
+    void deallocate(void*, size_t) noexcept { live.fetch_sub(1, std::memory_order_release); }
+
+    // Reclaims everything at once. Every object allocated since the last
+    // reset must already have been destroyed.
+    void reset() {
+        if (live.load(std::memory_order_acquire) != 0) {
+            throw std::logic_error("graphArena reset while graph objects are alive");
+        }
+        current = 0;
+        offset = 0;
+    }
+
+    size_t liveObjects() const { return live.load(std::memory_order_acquire); }
+
+    static graphArena*& active() {
+        static thread_local graphArena* arena = nullptr;
+        return arena;
+    }
+};
+
+// Routes graph allocations on the current thread to an arena for its
+// lifetime.
+class arenaScope {
+    graphArena* previous;
+public:
+    explicit arenaScope(graphArena& arena) : previous(graphArena::active()) {
+        graphArena::active() = &arena;
+    }
+    ~arenaScope() { graphArena::active() = previous; }
+
+    arenaScope(const arenaScope&) = delete;
+    arenaScope& operator=(const arenaScope&) = delete;
+};
+
+// Without an arena it falls back to the heap, so a container can simply
+// take whichever arena is active where it is built.
+template <typename U>
+class arenaAllocator {
+public:
+    using value_type = U;
+    graphArena* arena;
+
+    explicit arenaAllocator(graphArena* a) : arena(a) {}
+    template <typename V>
+    arenaAllocator(const arenaAllocator<V>& other) : arena(other.arena) {}
+
+    U* allocate(size_t n) {
+        if (!arena) {
+            return static_cast<U*>(::operator new(n * sizeof(U)));
+        }
+        return static_cast<U*>(arena->allocate(n * sizeof(U), alignof(U)));
+    }
+    void deallocate(U* p, size_t n) noexcept {
+        if (arena) {
+            arena->deallocate(p, n * sizeof(U));
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template <typename V>
+    bool operator==(const arenaAllocator<V>& other) const { return arena == other.arena; }
+    template <typename V>
+    bool operator!=(const arenaAllocator<V>& other) const { return arena != other.arena; }
+};
+
+// Allocates a graph node or backop in the active arena, if any.
+template <typename U, typename... Args>
+std::shared_ptr<U> makeGraphObject(Args&&... args) {
+    if (graphArena* arena = graphArena::active()) {
+        return std::allocate_shared<U>(arenaAllocator<U>(arena), std::forward<Args>(args)...);
+    }
+    return std::make_shared<U>(std::forward<Args>(args)...);
+}
+
+// ===================== Backop =====================
+// A backop receives the total gradient of the tensor it produced and hands
+// each input its contribution through gradNode::accumulate. It never
+// recurses; the backwardEngine decides when an input is ready to propagate.
+// Ops keep only what their formula reads: the inputs' nodes as gradient
+// destinations, plus shared views of operand data where needed. The edge
+// list is allocated next to the op, in the arena active when it is built.
+template <typename T, class C = xt::xarray<T>>
+class backop {
+public:
+    using nodePtr = std::shared_ptr<gradNode<T, C>>;
+    using edgeList = std::vector<nodePtr, arenaAllocator<nodePtr>>;
+
+protected:
+    edgeList inputs;
+
+    friend class gradNode<T, C>;
+
+public:
+    backop(std::initializer_list<nodePtr> in)
+        : inputs(in, arenaAllocator<nodePtr>(graphArena::active())) {}
+    virtual void backward(const C& accum_grad) = 0;
+    virtual ~backop() = default;
+
+    // Drops saved operand data ahead of the inputs, so tearing down a long
+    // chain never nests one teardown inside another.
+    virtual void releaseSaved() {}
+
+    // Batched variant of backward: grads stacks one gradient per seed along
+    // a leading axis, and each input's stack is accumulated through pass.
+    virtual void backwardBatch(const xt::xarray<T>&, batchPass<T, C>&) {
+        throw std::logic_error("Batched backward is not supported by this op");
+    }
+
+    const edgeList& getInputs() const { return inputs; }
+};
+
+// ===================== Buffer Pool =====================
+// Per-thread cache of tensor buffers keyed by element count. Forward
+// results and gradient buffers are drawn from it and handed back when a
+// tensor or pass buffer dies, so a training loop that sees the same shapes
+// every step stops going through the allocator. A cached buffer is
+// reshaped on reuse, which never reallocates for an equal element count.
+// Buffers below minPooledSize elements bypass the cache; the total cached
+// per thread is bounded by the capacity (0 disables pooling). Fixed-shape
+// containers live inline and are never pooled.
+template <class C>
+class bufferPool {
+    using T = typename C::value_type;
+
+public:
+    static constexpr size_t minPooledSize = 64;
+
+    template <class S>
+    static C acquire(const S& shape) {
+        if constexpr (isFixedContainer<C>::value) {
+            return C();
+        } else {
+            size_t n = 1;
+            for (auto extent : shape) {
+                n *= extent;
+            }
+            cache* c = local();
+            if (c && n >= minPooledSize) {
+                auto it = c->buckets.find(n);
+                if (it != c->buckets.end() && !it->second.empty()) {
+                    C buf = std::move(it->second.back());
+                    it->second.pop_back();
+                    c->bytes -= n * sizeof(T);
+                    buf.reshape(shape);
+                    return buf;
+                }
+            }
+            return C::from_shape(shape);
+        }
+    }
+
+    static void release(C&& buf) {
+        if constexpr (!isFixedContainer<C>::value) {
+            const size_t n = buf.size();
+            cache* c = local();
+            if (!c || n < minPooledSize || c->bytes + n * sizeof(T) > c->capacity) {
+                return;
+            }
+            c->bytes += n * sizeof(T);
+            c->buckets[n].push_back(std::move(buf));
+        }
+    }
+
+    static void setCapacity(size_t bytes) {
+        if (cache* c = local()) {
+            c->capacity = bytes;
+            if (c->bytes > bytes) {
+                clear();
+            }
+        }
+    }
+
+    static void clear() {
+        if (cache* c = local()) {
+            c->buckets.clear();
+            c->bytes = 0;
+        }
+    }
+
+    static size_t cachedBytes() {
+        cache* c = local();
+        return c ? c->bytes : 0;
+    }
+
+private:
+    struct cache {
+        std::unordered_map<size_t, std::vector<C>> buckets;
+        size_t bytes = 0;
+        size_t capacity = size_t(256) << 20;
+        ~cache() { destroyed() = true; }
+    };
+
+    // Tensors destroyed after their thread's cache (e.g. during static
+    // teardown) simply free their buffers.
+    static bool& destroyed() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    static cache* local() {
+        if (destroyed()) {
+            return nullptr;
+        }
+        static thread_local cache c;
+        return &c;
+    }
+};
+
+// ===================== Thread Pool =====================
+// Work-stealing pool shared by the parallel parts of the library. Each
+// worker owns a deque: tasks spawned on a worker go to the back of its own
+// deque and are popped from there, so a worker tends to continue the work
+// it just produced, while idle workers steal the oldest task from the front
+// of another deque. A thread waiting for a taskGroup runs queued tasks
+// instead of blocking, so nested waits cannot starve the pool.
+//
+// The size counts the calling thread: a pool of size 1 has no workers, and
+// callers take their serial path. The global pool starts at size 1.
+class threadPool {
+public:
+    explicit threadPool(size_t threads) {
+        for (size_t i = 1; i < threads; ++i) {
+            queues.push_back(std::make_unique<workQueue>());
+        }
+        for (size_t i = 0; i < queues.size(); ++i) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~threadPool() {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    size_t size() const { return workers.size() + 1; }
+
+    void submit(std::function<void()> task) {
+        if (queues.empty()) {
+            task();
+            return;
+        }
+        const size_t q = current().pool == this
+                             ? current().index
+                             : next.fetch_add(1, std::memory_order_relaxed) % queues.size();
+        {
+            std::lock_guard<std::mutex> guard(queues[q]->lock);
+            queues[q]->tasks.push_back(std::move(task));
+        }
+        queued.fetch_add(1);
+        notifyAll();
+    }
+
+    // Runs queued tasks on the calling thread until done() holds.
+    template <class Done>
+    void helpUntil(const Done& done) {
+        while (!done()) {
+            if (!runOne()) {
+                std::unique_lock<std::mutex> guard(sleepLock);
+                wake.wait(guard, [&] { return done() || queued.load() > 0 || stopping; });
+            }
+        }
+    }
+
+    // Wakes sleeping threads so they re-check their wait condition.
+    void notifyAll() {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        wake.notify_all();
+    }
+
+    static threadPool& global() {
+        std::lock_guard<std::mutex> guard(globalLock());
+        auto& pool = globalPool();
+        if (!pool) {
+            pool = std::make_unique<threadPool>(1);
+        }
+        return *pool;
+    }
+
+    // Resizes the global pool. Must not be called while it is running work.
+    static void setThreadCount(size_t threads) {
+        std::lock_guard<std::mutex> guard(globalLock());
+        auto& pool = globalPool();
+        pool.reset();
+        pool = std::make_unique<threadPool>(std::max<size_t>(threads, 1));
+    }
+
+    static size_t threadCount() { return global().size(); }
+
+    // Elementwise loops shorter than this many elements stay serial.
+    static void setParallelThreshold(size_t elements) {
+        thresholdValue().store(std::max<size_t>(elements, 1), std::memory_order_relaxed);
+    }
+
+    static size_t parallelThreshold() {
+        return thresholdValue().load(std::memory_order_relaxed);
+    }
+
+private:
+    struct workQueue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    struct workerId {
+        const threadPool* pool = nullptr;
+        size_t index = 0;
+    };
+
+    std::vector<std::unique_ptr<workQueue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> next{0};
+    std::atomic<bool> stopping{false};
+    std::mutex sleepLock;
+    std::condition_variable wake;
+
+    static workerId& current() {
+        static thread_local workerId id;
+        return id;
+    }
+
+    static std::mutex& globalLock() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unique_ptr<threadPool>& globalPool() {
+        static std::unique_ptr<threadPool> pool;
+        return pool;
+    }
+
+    static std::atomic<size_t>& thresholdValue() {
+        static std::atomic<size_t> elements{size_t(1) << 15};
+        return elements;
+    }
+
+    void workerLoop(size_t index) {
+        current() = {this, index};
+        helpUntil([this] { return stopping.load(); });
+    }
+
+    // Own deque from the back first, then the others from the front.
+    bool runOne() {
+        std::function<void()> task;
+        const bool own = current().pool == this;
+        const size_t start = own ? current().index : 0;
+        if (own) {
+            workQueue& q = *queues[start];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+        }
+        for (size_t k = own ? 1 : 0; !task && k < queues.size(); ++k) {
+            workQueue& q = *queues[(start + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        queued.fetch_sub(1);
+        task();
+        return true;
+    }
+};
+
+// A batch of tasks on a pool. wait() returns once all of them have
+// finished and rethrows the first exception any of them raised; tasks
+// started after a failure are skipped.
+class taskGroup {
+public:
+    explicit taskGroup(threadPool& p) : pool(p) {}
+
+    ~taskGroup() {
+        pool.helpUntil([this] { return remaining.load() == 0; });
+    }
+
+    template <class F>
+    void run(F&& f) {
+        remaining.fetch_add(1);
+        pool.submit([this, f = std::forward<F>(f)]() mutable {
+            if (!failed.load()) {
+                try {
+                    f();
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(errorLock);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    failed = true;
+                }
+            }
+            // The group may be gone as soon as remaining reaches zero.
+            threadPool& p = pool;
+            if (remaining.fetch_sub(1) == 1) {
+                p.notifyAll();
+            }
+        });
+    }
+
+    void wait() {
+        pool.helpUntil([this] { return remaining.load() == 0; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    bool cancelled() const { return failed.load(); }
+
+private:
+    threadPool& pool;
+    std::atomic<size_t> remaining{0};
+    std::atomic<bool> failed{false};
+    std::mutex errorLock;
+    std::exception_ptr error;
+};
+
+// A fixed table of mutexes picked by address, for objects too small or too
+// numerous to carry a mutex of their own.
+inline std::mutex& stripeLock(const void* p) {
+    static std::mutex locks[64];
+    return locks[(reinterpret_cast<uintptr_t>(p) >> 6) % 64];
+}
+
+// Splits [0, n) into contiguous chunks, about one per pool thread, and runs
+// body(begin, end) on each. Ranges under the parallel threshold, and all
+// ranges when the pool has no workers, run inline. The caller claims chunks
+// from the same counter as the workers and never runs unrelated pool work
+// while it waits, so this is safe to call from a backward task holding a
+// node's lock. body must not throw.
+template <class F>
+void parallelFor(size_t n, const F& body) {
+    if (n < threadPool::parallelThreshold()) {
+        body(size_t(0), n);
+        return;
+    }
+    threadPool& pool = threadPool::global();
+    // Chunk edges fall on multiples of 16 elements to keep vector loops
+    // and cache lines whole.
+    const size_t step = ((n + pool.size() - 1) / pool.size() + 15) & ~size_t(15);
+    const size_t chunks = (n + step - 1) / step;
+    if (chunks <= 1) {
+        body(size_t(0), n);
+        return;
+    }
+    // Workers that start after every chunk is claimed touch only the
+    // shared state, never body.
+    struct state {
+        std::atomic<size_t> next{0};
+        size_t done = 0;
+        std::mutex lock;
+        std::condition_variable finished;
+    };
+    auto shared = std::make_shared<state>();
+    const F* fn = &body;
+    auto work = [shared, fn, n, step, chunks] {
+        for (size_t c; (c = shared->next.fetch_add(1)) < chunks;) {
+            (*fn)(c * step, std::min(n, (c + 1) * step));
+            std::lock_guard<std::mutex> guard(shared->lock);
+            if (++shared->done == chunks) {
+                shared->finished.notify_all();
+            }
+        }
+    };
+    for (size_t c = 1; c < chunks; ++c) {
+        pool.submit(work);
+    }
+    work();
+    std::unique_lock<std::mutex> guard(shared->lock);
+    shared->finished.wait(guard, [&] { return shared->done == chunks; });
+}
+
+// out[i] += src[i] over contiguous buffers of n elements.
+template <typename T>
+void addInto(T* __restrict out, const T* __restrict src, size_t n) {
+    parallelFor(n, [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            out[i] += src[i];
+        }
+    });
+}
+
+// ===================== Profiler =====================
+// Built with GRADTENSOR_PROFILE, every forward op and every backop run is
+// timed and recorded with the bytes it allocated for values and for
+// gradient buffers, and the object it produced. gradTape records count as
+// ops in both directions, and a lazy chain's eval() as one forward op
+// named "fused". Without the flag the hooks below expand to nothing.
+// profiler::global() collects the events from all threads; writeTrace()
+// emits Chrome trace JSON (chrome://tracing, Perfetto) and writeSummary()
+// a per-op table.
+#ifdef GRADTENSOR_PROFILE
+class profiler {
+public:
+    struct event {
+        const char* name;
+        bool backward;
+        uint64_t start;
+        uint64_t duration;
+        size_t thread;
+        const void* node;
+        size_t dataBytes;
+        size_t gradBytes;
+    };
+
+    struct summary {
+        size_t forwardCalls = 0;
+        size_t backwardCalls = 0;
+        uint64_t forwardNs = 0;
+        uint64_t backwardNs = 0;
+        size_t dataBytes = 0;
+        size_t gradBytes = 0;
+    };
+
+    static profiler& global() {
+        static profiler instance;
+        return instance;
+    }
+
+    static uint64_t now() {
+        return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void record(const event& e) {
+        std::lock_guard<std::mutex> guard(lock);
+        events.push_back(e);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        events.clear();
+    }
+
+    std::vector<event> getEvents() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return events;
+    }
+
+    std::map<std::string, summary> summarize() const {
+        std::map<std::string, summary> table;
+        for (const event& e : getEvents()) {
+            summary& s = table[e.name];
+            if (e.backward) {
+                ++s.backwardCalls;
+                s.backwardNs += e.duration;
+            } else {
+                ++s.forwardCalls;
+                s.forwardNs += e.duration;
+            }
+            s.dataBytes += e.dataBytes;
+            s.gradBytes += e.gradBytes;
+        }
+        return table;
+    }
+
+    // Complete ("X") events in microseconds, one track per thread.
+    void writeTrace(std::ostream& os) const {
+        const std::vector<event> list = getEvents();
+        const uint64_t origin = list.empty() ? 0 : std::min_element(list.begin(), list.end(),
+            [](const event& a, const event& b) { return a.start < b.start; })->start;
+        os << "{\"traceEvents\":[";
+        for (size_t i = 0; i < list.size(); ++i) {
+            const event& e = list[i];
+            os << (i ? ",\n" : "\n") << "{\"name\":\"" << e.name << "\",\"cat\":\""
+               << (e.backward ? "backward" : "forward") << "\",\"ph\":\"X\",\"ts\":"
+               << double(e.start - origin) / 1e3 << ",\"dur\":" << double(e.duration) / 1e3
+               << ",\"pid\":0,\"tid\":" << e.thread << ",\"args\":{\"node\":\"" << e.node
+               << "\",\"dataBytes\":" << e.dataBytes << ",\"gradBytes\":" << e.gradBytes
+               << "}}";
+        }
+        os << "\n]}\n";
+    }
+
+    // Ops by total time, most expensive first.
+    void writeSummary(std::ostream& os) const {
+        const std::map<std::string, summary> table = summarize();
+        std::vector<std::pair<std::string, summary>> rows(table.begin(), table.end());
+        std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+            return a.second.forwardNs + a.second.backwardNs >
+                   b.second.forwardNs + b.second.backwardNs;
+        });
+        os << std::left << std::setw(28) << "op" << std::right << std::setw(10) << "fwd calls"
+           << std::setw(12) << "fwd ms" << std::setw(10) << "bwd calls" << std::setw(12)
+           << "bwd ms" << std::setw(14) << "data KiB" << std::setw(14) << "grad KiB" << "\n";
+        for (const auto& [name, s] : rows) {
+            os << std::left << std::setw(28) << name << std::right << std::setw(10)
+               << s.forwardCalls << std::setw(12) << std::fixed << std::setprecision(3)
+               << double(s.forwardNs) / 1e6 << std::setw(10) << s.backwardCalls << std::setw(12)
+               << double(s.backwardNs) / 1e6 << std::setw(14) << double(s.dataBytes) / 1024.0
+               << std::setw(14) << double(s.gradBytes) / 1024.0 << "\n";
+        }
+        os.unsetf(std::ios::floatfield);
+    }
+
+private:
+    mutable std::mutex lock;
+    std::vector<event> events;
+};
+
+// Times the enclosing block as one event. Scopes nest per thread, and
+// allocations are charged to the innermost one.
+class profileScope {
+    profiler::event e;
+    profileScope* outer;
+
+    static profileScope*& current() {
+        static thread_local profileScope* scope = nullptr;
+        return scope;
+    }
+
+    static size_t threadIndex() {
+        static std::atomic<size_t> next{0};
+        static thread_local size_t index = next.fetch_add(1);
+        return index;
+    }
+
+public:
+    profileScope(const char* name, bool backward, const void* node = nullptr)
+        : e{name, backward, profiler::now(), 0, threadIndex(), node, 0, 0}, outer(current()) {
+        current() = this;
+    }
+
+    ~profileScope() {
+        e.duration = profiler::now() - e.start;
+        current() = outer;
+        profiler::global().record(e);
+    }
+
+    profileScope(const profileScope&) = delete;
+    profileScope& operator=(const profileScope&) = delete;
+
+    // The op's result: its node once it has one, the tensor otherwise.
+    template <class P>
+    static void result(const P& tensor) {
+        if (profileScope* s = current()) {
+            s->e.node = tensor->getSource() ? static_cast<const void*>(tensor->gradEdge().get())
+                                            : static_cast<const void*>(tensor.get());
+            s->e.dataBytes += tensor->getData().size() * sizeof(tensor->getData().data()[0]);
+        }
+    }
+
+    static void gradBytes(size_t bytes) {
+        if (profileScope* s = current()) {
+            s->e.gradBytes += bytes;
+        }
+    }
+};
+
+// Readable backop names, demangled once per type with the template
+// arguments stripped.
+template <class Op>
+const char* backopName(const Op& op) {
+    static std::mutex lock;
+    static std::unordered_map<std::type_index, std::string> names;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = names.find(typeid(op));
+    if (it == names.end()) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(typeid(op).name(), nullptr, nullptr, &status);
+        std::string name = status == 0 ? demangled : typeid(op).name();
+        free(demangled);
+        it = names.emplace(typeid(op), name.substr(0, name.find('<'))).first;
+    }
+    return it->second.c_str();
+}
+
+#define GRADTENSOR_PROFILE_FORWARD(name) profileScope profileScope_(name, false)
+#define GRADTENSOR_PROFILE_BACKWARD(name, node) profileScope profileScope_(name, true, node)
+#define GRADTENSOR_PROFILE_RESULT(tensor) profileScope::result(tensor)
+#define GRADTENSOR_PROFILE_GRAD(bytes) profileScope::gradBytes(bytes)
+#else
+#define GRADTENSOR_PROFILE_FORWARD(name)
+#define GRADTENSOR_PROFILE_BACKWARD(name, node)
+#define GRADTENSOR_PROFILE_RESULT(tensor)
+#define GRADTENSOR_PROFILE_GRAD(bytes)
+#endif
+
+// ===================== gradNode =====================
+// The autograd half of a tensor: where its gradient is accumulated and the
+// backop that produced it. Backops point at their inputs' nodes rather than
+// at the tensors themselves, so an input whose values no backward formula
+// needs can free its data as soon as its last user drops it, while the
+// gradient path through it stays intact.
+//
+// All gradient state is guarded by the node's lock, so leaves can be
+// shared by graphs built and backpropagated on different threads at the
+// same time, e.g. one parameter set serving several requests or Hogwild
+// workers. Interior nodes belong to the pass that consumes them.
+template <typename T, class C>
+class gradNode {
+private:
+    using shape_type = typename C::shape_type;
+
+    shape_type shape;
+    // Allocated by the first backward pass that reaches this node.
+    C grad;
+    bool hasGrad = false;
+    // What getGrad() returns before any pass has reached this node.
+    mutable C zeros;
+    mutable bool hasZeros = false;
+    std::shared_ptr<backop<T, C>> source;
+
+    // Sum of the contributions received during the current backward pass.
+    // It is only propagated once every consumer has been processed.
+    C pending;
+    bool hasPending = false;
+    // Set once a backward pass has released this node's source.
+    bool graphReleased = false;
+    // Serializes contributions from consumers running on different threads
+    // and from concurrent passes that share this node.
+    mutable std::mutex accumulateLock;
+
+    friend class backwardEngine<T, C>;
+
+    template <class S>
+    void checkGradShape(const S& other) const {
+        if (other.size() != shape.size() ||
+            !std::equal(other.begin(), other.end(), shape.begin())) {
+            throw std::invalid_argument("Gradient shape mismatch");
+        }
+    }
+
+    // A fixed-shape gradient of type C matches by construction.
+    void checkGradShape(const C& other) const {
+        if constexpr (!isFixedContainer<C>::value) {
+            checkGradShape(other.shape());
+        }
+    }
+
+public:
+    explicit gradNode(const shape_type& s) : shape(s) {}
+
+    // Tears the graph down with a worklist instead of letting each
+    // shared_ptr release recurse into the next level.
+    ~gradNode() {
+        std::vector<std::shared_ptr<backop<T, C>>> ops;
+        if (source) {
+            ops.push_back(std::move(source));
+        }
+        while (!ops.empty()) {
+            std::shared_ptr<backop<T, C>> op = std::move(ops.back());
+            ops.pop_back();
+            if (op.use_count() != 1) {
+                continue;
+            }
+            op->releaseSaved();
+            for (auto& input : op->inputs) {
+                if (input.use_count() == 1 && input->source) {
+                    ops.push_back(std::move(input->source));
+                }
+            }
+        }
+        bufferPool<C>::release(std::move(grad));
+        bufferPool<C>::release(std::move(pending));
+        bufferPool<C>::release(std::move(zeros));
+    }
+
+    const shape_type& getShape() const { return shape; }
+
+    // Reading the gradient of a node no backward pass has reached yet
+    // gives zeros, kept apart from grad so the read does not count as a
+    // gradient for hasGradient().
+    const C& getGrad() const {
+        std::lock_guard<std::mutex> guard(accumulateLock);
+        if (hasGrad) {
+            return grad;
+        }
+        if (!hasZeros) {
+            zeros = xt::zeros<T>(shape);
+            hasZeros = true;
+        }
+        return zeros;
+    }
+    bool hasGradient() const {
+        std::lock_guard<std::mutex> guard(accumulateLock);
+        return hasGrad;
+    }
+
+    // Rewrites an existing gradient in place, e.g. to unscale it after a
+    // loss-scaled backward.
+    template <class F>
+    void updateGrad(F&& f) {
+        std::lock_guard<std::mutex> guard(accumulateLock);
+        if (hasGrad) {
+            f(grad);
+        }
+    }
+
+    // Adds straight to the gradient, bypassing the pass buffer; for
+    // executors that schedule their own backward, such as gradTape.
+    void accumulateGrad(const C& grad_current) {
+        checkGradShape(grad_current);
+        std::lock_guard<std::mutex> guard(accumulateLock);
+        if (hasGrad) {
+            addInto(grad.data(), grad_current.data(), grad_current.size());
+        } else {
+            grad = grad_current;
+            hasGrad = true;
+        }
+    }
+
+    void setSource(std::shared_ptr<backop<T, C>> op) { source = op; }
+    std::shared_ptr<backop<T, C>> getSource() const { return source; }
+
+    void accumulate(const C& grad_current) {
+        checkGradShape(grad_current);
+        std::lock_guard<std::mutex> guard(accumulateLock);
+        bool fresh;
+        T* out = pendingData(fresh);
+        const T* src = grad_current.data();
+        if (fresh) {
+            parallelFor(grad_current.size(), [=](size_t begin, size_t end) {
+                std::copy(src + begin, src + end, out + begin);
+            });
+        } else {
+            addInto(out, src, grad_current.size());
+        }
+    }
+
+    // The first contribution of a pass is moved in rather than copied.
+    void accumulate(C&& grad_current) {
+        checkGradShape(grad_current);
+        std::lock_guard<std::mutex> guard(accumulateLock);
+        if (hasPending) {
+            addInto(pending.data(), grad_current.data(), grad_current.size());
+        } else {
+            GRADTENSOR_PROFILE_GRAD(grad_current.size() * sizeof(T));
+            pending = std::move(grad_current);
+            hasPending = true;
+        }
+    }
+
+    // Evaluates an unevaluated xtensor expression straight into the pass
+    // buffer, so backops can hand over e.g. `a * g` without building it.
+    template <class E>
+    void accumulate(const xt::xexpression<E>& grad_expr) {
+        const E& expr = grad_expr.derived_cast();
+        checkGradShape(expr.shape());
+        std::lock_guard<std::mutex> guard(accumulateLock);
+        if (hasPending) {
+            xt::noalias(pending) += expr;
+        } else {
+            pending = bufferPool<C>::acquire(shape);
+            GRADTENSOR_PROFILE_GRAD(pending.size() * sizeof(T));
+            xt::noalias(pending) = expr;
+            hasPending = true;
+        }
+    }
+
+    // Accumulates scale * grad_current in one pass without a temporary.
+    void accumulate(T scale, const C& grad_current) {
+        checkGradShape(grad_current);
+        std::lock_guard<std::mutex> guard(accumulateLock);
+        bool fresh;
+        T* out = pendingData(fresh);
+        const T* src = grad_current.data();
+        parallelFor(grad_current.size(), [=](size_t begin, size_t end) {
+            if (fresh) {
+                for (size_t i = begin; i < end; ++i) {
+                    out[i] = scale * src[i];
+                }
+            } else {
+                for (size_t i = begin; i < end; ++i) {
+                    out[i] += scale * src[i];
+                }
+            }
+        });
+    }
+
+    // Raw pass buffer for backward kernels that write their contribution in
+    // place; the node stays locked for as long as the sink lives. On the
+    // first contribution of a pass the buffer is allocated uninitialized and
+    // 'fresh' is set, telling the kernel to assign rather than add. The
+    // caller guarantees the contribution has this shape.
+    struct sink {
+        std::unique_lock<std::mutex> guard;
+        T* data;
+        bool fresh;
+    };
+
+    sink gradientSink() {
+        sink s{std::unique_lock<std::mutex>(accumulateLock), nullptr, false};
+        s.data = pendingData(s.fresh);
+        return s;
+    }
+
+    // Sinks of two distinct nodes, locked together so that kernels taking
+    // them in opposite orders cannot deadlock.
+    static std::pair<sink, sink> gradientSinks(gradNode& a, gradNode& b) {
+        sink sa{std::unique_lock<std::mutex>(a.accumulateLock, std::defer_lock), nullptr, false};
+        sink sb{std::unique_lock<std::mutex>(b.accumulateLock, std::defer_lock), nullptr, false};
+        lock(sa.guard, sb.guard);
+        sa.data = a.pendingData(sa.fresh);
+        sb.data = b.pendingData(sb.fresh);
+        return {std::move(sa), std::move(sb)};
+    }
+
+private:
+    T* pendingData(bool& fresh) {
+        fresh = !hasPending;
+        if (fresh) {
+            pending = bufferPool<C>::acquire(shape);
+            GRADTENSOR_PROFILE_GRAD(pending.size() * sizeof(T));
+            hasPending = true;
+        }
+        return pending.data();
+    }
+};
+
+// ===================== gradTensor =====================
+// User-facing tensor: its values plus, once it takes part in a recorded
+// operation, the gradNode through which gradients reach it.
+template <typename T, class C>
+class gradTensor {
+private:
+    C data;
+    // Created on first use, so tensors that never enter a recorded graph
+    // carry no autograd state at all.
+    mutable std::shared_ptr<gradNode<T, C>> node;
+    // Bumped by every in-place modification of data.
+    std::atomic<uint64_t> version{0};
+
+public:
+    gradTensor() : data(), node(nullptr) {}
+    gradTensor(const C& d) 
+        : data(d), node(nullptr) {}
+    gradTensor(C&& d)
+        : data(std::move(d)), node(nullptr) {}
+    // Evaluates an xtensor expression straight into the tensor's buffer.
+    template <class E>
+    gradTensor(const xt::xexpression<E>& e)
+        : data(e), node(nullptr) {}
+
+    ~gradTensor() {
+        bufferPool<C>::release(std::move(data));
+    }
+
+    const C& getData() const { return data; }
+    const C& getGrad() const { return gradEdge()->getGrad(); }
+    uint64_t getVersion() const { return version.load(std::memory_order_acquire); }
+
+    // Write access to the values, counted as an in-place modification:
+    // backops that saved the previous values refuse to run afterwards.
+    C& mutableData() {
+        version.fetch_add(1, std::memory_order_acq_rel);
+        return data;
+    }
+    bool hasGradient() const {
+        std::shared_ptr<gradNode<T, C>> n;
+        {
+            std::lock_guard<std::mutex> guard(stripeLock(this));
+            n = node;
+        }
+        return n && n->hasGradient();
+    }
+
+    // An op result's node shares the lifetime of its graph, so it is placed
+    // in the active arena along with the backop. Takes the same stripe lock
+    // as gradEdge(), which another thread may be calling on this tensor.
+    void setSource(std::shared_ptr<backop<T, C>> op) {
+        std::lock_guard<std::mutex> guard(stripeLock(this));
+        if (!node) {
+            node = makeGraphObject<gradNode<T, C>>(data.shape());
+        }
+        node->setSource(std::move(op));
+    }
+    std::shared_ptr<backop<T, C>> getSource() const {
+        std::lock_guard<std::mutex> guard(stripeLock(this));
+        return node ? node->getSource() : nullptr;
+    }
+
+    // Gives the tensor a new node produced by op, for in-place operations
+    // recorded in grad mode. op has the previous node as an input, so the
+    // gradient of the old values still reaches the graph built on them.
+    void rebase(std::shared_ptr<backop<T, C>> op) {
+        auto fresh = makeGraphObject<gradNode<T, C>>(data.shape());
+        fresh->setSource(std::move(op));
+        std::lock_guard<std::mutex> guard(stripeLock(this));
+        node = std::move(fresh);
+    }
+
+    // The node backops send this tensor's gradient to. Leaves typically
+    // outlive any one iteration, so theirs always goes on the heap. A shared
+    // leaf may be first used by several threads at once, hence the lock;
+    // once created the node only changes through rebase, which like any
+    // in-place operation must not race with other uses of the tensor.
+    const std::shared_ptr<gradNode<T, C>>& gradEdge() const {
+        std::lock_guard<std::mutex> guard(stripeLock(this));
+        if (!node) {
+            node = std::make_shared<gradNode<T, C>>(data.shape());
+        }
+        return node;
+    }
+
+    // By default the graph behind this tensor is freed as it is consumed;
+    // pass retainGraph = true to run backward through it again later.
+    void backward(const C& grad_current, bool retainGraph = false) {
+        backwardEngine<T, C>::run(gradEdge(), grad_current, retainGraph);
+    }
+
+    void backward(bool retainGraph = false) {
+        C seed = bufferPool<C>::acquire(data.shape());
+        seed.fill(T(1));
+        backwardEngine<T, C>::run(gradEdge(), std::move(seed), retainGraph);
+    }
+};
+
+// A tensor's values as saved by a backop that reads them during backward.
+// It remembers the tensor's version, and reading the values after the
+// tensor was modified in place throws rather than producing a wrong
+// gradient.
+template <typename T, class C>
+class savedTensor {
+    std::shared_ptr<const gradTensor<T, C>> tensor;
+    uint64_t version = 0;
+
+    void check() const {
+        if (tensor->getVersion() != version) {
+            throw std::logic_error("A tensor needed for backward has been modified by an "
+                                   "in-place operation");
+        }
+    }
+
+public:
+    savedTensor() = default;
+    explicit savedTensor(std::shared_ptr<const gradTensor<T, C>> t)
+        : tensor(std::move(t)), version(tensor->getVersion()) {}
+
+    const C& operator*() const {
+        check();
+        return tensor->getData();
+    }
+    const C* operator->() const { return &**this; }
+
+    void reset() { tensor.reset(); }
+};
+
+template <typename T, class C>
+savedTensor<T, C> savedData(const std::shared_ptr<gradTensor<T, C>>& tensor) {
+    return savedTensor<T, C>(tensor);
+}
+
+// ===================== Backward Engine =====================
+// Open-addressing map from a node's address to its position in a pass's
+// order, doubling as the visited set of the walk. Clearing keeps the
+// table, so a pass over a graph no larger than earlier ones allocates
+// nothing for its bookkeeping.
+class nodeIndex {
+    std::vector<std::pair<const void*, size_t>> table;
+    size_t count = 0;
+    unsigned bits = 0;
+
+    // Fibonacci hashing of the address into a table of 2^bits slots.
+    size_t probe(const void* key) const {
+        const size_t mask = table.size() - 1;
+        size_t i = size_t((uint64_t(reinterpret_cast<uintptr_t>(key)) *
+                           0x9e3779b97f4a7c15ull) >> (64 - bits));
+        while (table[i].first && table[i].first != key) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow() {
+        std::vector<std::pair<const void*, size_t>> old(size_t(1) << (bits ? bits + 1 : 6));
+        std::swap(old, table);
+        bits = bits ? bits + 1 : 6;
+        for (const auto& e : old) {
+            if (e.first) {
+                table[probe(e.first)] = e;
+            }
+        }
+    }
+
+public:
+    // Adds key unless it is already present; returns whether it was added.
+    bool insert(const void* key, size_t value) {
+        if (2 * (count + 1) > table.size()) {
+            grow();
+        }
+        auto& e = table[probe(key)];
+        if (e.first) {
+            return false;
+        }
+        e = {key, value};
+        ++count;
+        return true;
+    }
+
+    // The value of a key that is present.
+    size_t& operator[](const void* key) { return table[probe(key)].second; }
+    size_t at(const void* key) const { return table[probe(key)].second; }
+
+    void clear() {
+        if (count) {
+            std::fill(table.begin(), table.end(), std::pair<const void*, size_t>(nullptr, 0));
+            count = 0;
+        }
+    }
+};
+
+// Runs reverse mode over the graph reachable from a root. Nodes are visited
+// in reverse topological order, so a node's source runs exactly once, after
+// all of its consumers have accumulated into it. Cost is linear in the number
+// of nodes and edges, regardless of how often subexpressions are reused.
+// When the global threadPool has workers, independent branches run on them
+// concurrently.
+//
+// Unless retainGraph is set, each node's source is dropped as soon as it has
+// run, which releases the saved operands and every intermediate nobody else
+// holds while the pass is still going.
+template <typename T, class C>
+class backwardEngine {
+    using nodePtr = std::shared_ptr<gradNode<T, C>>;
+
+    // The buffers of a pass, kept per thread and reused by later passes. A
+    // backop may run a nested pass, e.g. a checkpoint, so each nesting
+    // depth has a set of its own.
+    struct scratch {
+        std::vector<nodePtr> order;
+        std::vector<std::pair<nodePtr, size_t>> stack;
+        nodeIndex index;
+        std::unique_ptr<std::atomic<size_t>[]> waiting;
+        size_t waitingSize = 0;
+    };
+
+    class scratchLease {
+        scratch* s;
+
+        static std::vector<std::unique_ptr<scratch>>& levels() {
+            static thread_local std::vector<std::unique_ptr<scratch>> list;
+            return list;
+        }
+        static size_t& depth() {
+            static thread_local size_t d = 0;
+            return d;
+        }
+
+    public:
+        scratchLease() {
+            auto& list = levels();
+            if (depth() == list.size()) {
+                list.push_back(std::make_unique<scratch>());
+            }
+            s = list[depth()++].get();
+        }
+        ~scratchLease() {
+            s->order.clear();
+            s->stack.clear();
+            s->index.clear();
+            --depth();
+        }
+
+        scratchLease(const scratchLease&) = delete;
+        scratchLease& operator=(const scratchLease&) = delete;
+
+        scratch& operator*() const { return *s; }
+        scratch* operator->() const { return s; }
+    };
+
+public:
+    template <class Seed>
+    static void run(const nodePtr& root, Seed&& seed, bool retainGraph) {
+        scratchLease pass;
+        std::vector<nodePtr>& order = pass->order;
+        topoSort(root, *pass);
+
+        root->accumulate(std::forward<Seed>(seed));
+        threadPool& pool = threadPool::global();
+        if (pool.size() > 1 && order.size() > 1) {
+            runParallel(*pass, retainGraph, pool);
+            return;
+        }
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            propagate(it->get());
+            release(it->get(), retainGraph);
+            // The node's inputs are still held further down the order, so
+            // dropping this reference cannot free anything not yet processed.
+            it->reset();
+        }
+    }
+
+    // Propagates a stack of seeds through the graph in one walk; see
+    // batchPass. Serial, and the nodes' own gradients are left untouched.
+    static void runBatch(const nodePtr& root, const xt::xarray<T>& seeds, bool retainGraph,
+                         batchPass<T, C>& pass) {
+        scratchLease walk;
+        std::vector<nodePtr>& order = walk->order;
+        topoSort(root, *walk);
+        pass.accumulate(*root, seeds);
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            gradNode<T, C>* node = it->get();
+            if (node->source) {
+                xt::xarray<T> grads;
+                if (pass.extract(*node, grads)) {
+                    node->source->backwardBatch(grads, pass);
+                }
+            }
+            release(node, retainGraph);
+            it->reset();
+        }
+    }
+
+private:
+    // Runs the node's source on its accumulated gradient, then folds that
+    // gradient into the node's own. The node stays locked throughout, since
+    // a leaf's pass buffer may be receiving contributions from another
+    // pass; locks are only ever taken from a node towards its inputs, so
+    // the graph being acyclic rules out deadlock.
+    static void propagate(gradNode<T, C>* node) {
+        std::lock_guard<std::mutex> guard(node->accumulateLock);
+        if (!node->hasPending) {
+            return;
+        }
+        if (node->source) {
+            GRADTENSOR_PROFILE_BACKWARD(backopName(*node->source), node);
+            node->source->backward(node->pending);
+        }
+        if (node->hasGrad) {
+            addInto(node->grad.data(), node->pending.data(), node->pending.size());
+            bufferPool<C>::release(std::move(node->pending));
+        } else {
+            node->grad = std::move(node->pending);
+            node->hasGrad = true;
+        }
+        node->pending = C();
+        node->hasPending = false;
+    }
+
+    static void release(gradNode<T, C>* node, bool retainGraph) {
+        if (!retainGraph && node->source) {
+            node->source.reset();
+            node->graphReleased = true;
+        }
+    }
+
+    // Dependency-counting scheduler. A node becomes runnable once every
+    // consumer in the graph has contributed to it. Of the inputs a node
+    // makes runnable, all but one go to the pool and the last is continued
+    // on the same thread, so a chain never goes through the pool.
+    static void runParallel(scratch& pass, bool retainGraph, threadPool& pool) {
+        std::vector<nodePtr>& order = pass.order;
+        const nodeIndex& index = pass.index;
+        const size_t n = order.size();
+        if (pass.waitingSize < n) {
+            pass.waiting.reset(new std::atomic<size_t>[n]);
+            pass.waitingSize = n;
+        }
+        std::atomic<size_t>* waiting = pass.waiting.get();
+        for (size_t i = 0; i < n; ++i) {
+            waiting[i].store(0, std::memory_order_relaxed);
+        }
+        for (const auto& node : order) {
+            if (node->source) {
+                for (const auto& input : node->source->getInputs()) {
+                    waiting[index.at(input.get())].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        taskGroup group(pool);
+        std::function<void(size_t)> process = [&](size_t i) {
+            while (true) {
+                gradNode<T, C>* node = order[i].get();
+                propagate(node);
+                size_t follow = n;
+                if (node->source) {
+                    for (const auto& input : node->source->getInputs()) {
+                        const size_t j = index.at(input.get());
+                        if (waiting[j].fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                            continue;
+                        }
+                        if (follow != n) {
+                            group.run([&process, follow] { process(follow); });
+                        }
+                        follow = j;
+                    }
+                }
+                release(node, retainGraph);
+                // Every consumer of this node has finished, and its inputs
+                // are held by their own slots until they run.
+                order[i].reset();
+                if (follow == n || group.cancelled()) {
+                    return;
+                }
+                i = follow;
+            }
+        };
+        // The root comes last in the post-order.
+        group.run([&process, n] { process(n - 1); });
+        group.wait();
+    }
+
+    // Post-order DFS: every node is appended after all of its inputs, and
+    // the index records where. The walk keeps its own stack on the heap, so
+    // graph depth is bounded by memory rather than by the native call stack.
+    // The order owns a reference to every node, so releasing sources
+    // mid-pass never destroys a pending node.
+    static void topoSort(const nodePtr& root, scratch& pass) {
+        std::vector<nodePtr>& order = pass.order;
+        nodeIndex& visited = pass.index;
+        // Each frame is a node plus the index of the next input to visit.
+        auto& stack = pass.stack;
+        visited.insert(root.get(), 0);
+        stack.emplace_back(root, 0);
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            gradNode<T, C>* node = frame.first.get();
+            if (node->graphReleased) {
+                throw std::logic_error("Trying to backward through a graph that has already been "
+                                       "released; pass retainGraph = true to the first backward");
+            }
+            const backop<T, C>* op = node->source.get();
+            if (op && frame.second < op->getInputs().size()) {
+                const nodePtr& input = op->getInputs()[frame.second++];
+                if (visited.insert(input.get(), 0)) {
+                    stack.emplace_back(input, 0);
+                }
+                continue;
+            }
+            visited[node] = order.size();
+            order.push_back(std::move(frame.first));
+            stack.pop_back();
+        }
+    }
+};
+
+// ===================== Broadcasting =====================
+// NumPy rules: shapes are aligned on their trailing axes and each pair of
+// extents must match or contain a 1. Returns false if they are incompatible.
+template <class S1, class S2, class R>
+bool broadcastShape(const S1& a, const S2& b, R& out) {
+    const size_t rank = std::max(a.size(), b.size());
+    if (!resizeShape(out, rank)) {
+        return false;
+    }
+    for (size_t i = 0; i < rank; ++i) {
+        size_t da = i + a.size() >= rank ? a[i + a.size() - rank] : 1;
+        size_t db = i + b.size() >= rank ? b[i + b.size() - rank] : 1;
+        if (da != db && da != 1 && db != 1) {
+            return false;
+        }
+        out[i] = da == 1 ? db : da;
+    }
+    return true;
+}
+
+// Sums a broadcast gradient over the axes that broadcasting expanded, so
+// that it takes the given smaller shape.
+template <typename T, class E, class S>
+xt::xarray<T> reduceToShape(const E& grad, const S& target) {
+    const auto& full = grad.shape();
+    const size_t lead = full.size() - target.size();
+    std::vector<size_t> axes;
+    for (size_t i = 0; i < lead; ++i) {
+        axes.push_back(i);
+    }
+    for (size_t i = 0; i < target.size(); ++i) {
+        if (target[i] == 1 && full[lead + i] != 1) {
+            axes.push_back(lead + i);
+        }
+    }
+    xt::xarray<T> reduced = xt::sum(grad, axes, xt::evaluation_strategy::immediate);
+    reduced.reshape(target);
+    return reduced;
+}
+
+// Accumulates a gradient computed at the broadcast result shape into a
+// node of a smaller shape. The broadcast axes are summed straight out of
+// the (possibly lazy) gradient expression, so the expanded per-operand
+// gradient is never materialized.
+template <typename T, class C, class E>
+void accumulateToShape(gradNode<T, C>& dest, const E& grad) {
+    if constexpr (isFixedContainer<C>::value) {
+        dest.accumulate(grad);
+        return;
+    }
+    const auto& target = dest.getShape();
+    const auto& full = grad.shape();
+    if (full.size() == target.size() && std::equal(full.begin(), full.end(), target.begin())) {
+        dest.accumulate(grad);
+        return;
+    }
+    dest.accumulate(reduceToShape<T>(grad, target));
+}
+
+// ===================== Batched Backward =====================
+// Propagates B seeds through a graph in a single walk. Every edge carries
+// a stack of B gradients along a new leading axis, so each op runs its
+// kernels once over the whole stack (its gemms see B times the rows)
+// instead of once per seed. A full Jacobian takes one pass with the
+// identity as seeds. Batched gradients are always xt::xarray, and the ops
+// of dynamic-shape graphs support it, lazy chains included, except
+// checkpoint and cast.
+template <typename T, class C>
+class batchPass {
+    size_t batch;
+    std::unordered_map<const gradNode<T, C>*, xt::xarray<T>> grads;
+    // Nodes whose stacks are the result and must outlive their processing.
+    std::unordered_set<const gradNode<T, C>*> kept;
+
+public:
+    explicit batchPass(size_t b) : batch(b) {}
+
+    size_t size() const { return batch; }
+
+    void keep(const gradNode<T, C>& node) { kept.insert(&node); }
+
+    std::vector<size_t> shapeOf(const gradNode<T, C>& node) const {
+        const auto& s = node.getShape();
+        std::vector<size_t> shape{batch};
+        shape.insert(shape.end(), s.begin(), s.end());
+        return shape;
+    }
+
+    // Adds a stack of contributions; one at a broadcast result shape is
+    // summed down to the node's shape first.
+    template <class E>
+    void accumulate(const gradNode<T, C>& node, const E& contribution) {
+        const std::vector<size_t> shape = shapeOf(node);
+        const auto& full = contribution.shape();
+        if (full.size() != shape.size() || !std::equal(full.begin(), full.end(), shape.begin())) {
+            // Pad the node's shape to the contribution's rank behind the
+            // batch axis, so the broadcast axes line up.
+            std::vector<size_t> padded(full.size(), 1);
+            padded[0] = batch;
+            std::copy(shape.begin() + 1, shape.end(), padded.end() - (shape.size() - 1));
+            xt::xarray<T> reduced = reduceToShape<T>(contribution, padded);
+            reduced.reshape(shape);
+            accumulate(node, reduced);
+            return;
+        }
+        auto it = grads.find(&node);
+        if (it == grads.end()) {
+            grads.emplace(&node, xt::xarray<T>(contribution));
+        } else {
+            xt::noalias(it->second) += contribution;
+        }
+    }
+
+    // Raw stack buffer for kernels writing in place, as gradNode::gradientSink.
+    T* sink(const gradNode<T, C>& node, bool& fresh) {
+        auto it = grads.find(&node);
+        fresh = it == grads.end();
+        if (fresh) {
+            it = grads.emplace(&node, xt::xarray<T>::from_shape(shapeOf(node))).first;
+        }
+        return it->second.data();
+    }
+
+    // The node's complete stack, handed over unless it is kept.
+    bool extract(const gradNode<T, C>& node, xt::xarray<T>& out) {
+        auto it = grads.find(&node);
+        if (it == grads.end()) {
+            return false;
+        }
+        if (kept.count(&node)) {
+            out = it->second;
+        } else {
+            out = std::move(it->second);
+            grads.erase(it);
+        }
+        return true;
+    }
+
+    // The stack reaching node, zeros if nothing did.
+    xt::xarray<T> result(const gradNode<T, C>& node) const {
+        auto it = grads.find(&node);
+        if (it == grads.end()) {
+            return xt::zeros<T>(shapeOf(node));
+        }
+        return it->second;
+    }
+};
+
+// Backpropagates seeds [B, output shape] and returns, for each input, the
+// stack [B, input shape] of gradients. The inputs' own gradients are not
+// changed.
+template <typename T>
+std::vector<xt::xarray<T>> backwardBatch(const std::shared_ptr<gradTensor<T>>& output,
+                                         const xt::xarray<T>& seeds,
+                                         const std::vector<std::shared_ptr<gradTensor<T>>>& inputs,
+                                         bool retainGraph = false) {
+    const auto& shape = output->getData().shape();
+    if (seeds.dimension() != shape.size() + 1 ||
+        !std::equal(shape.begin(), shape.end(), seeds.shape().begin() + 1)) {
+        throw std::invalid_argument("Seed shape mismatch");
+    }
+    batchPass<T> pass(seeds.shape()[0]);
+    for (const auto& input : inputs) {
+        pass.keep(*input->gradEdge());
+    }
+    backwardEngine<T>::runBatch(output->gradEdge(), seeds, retainGraph, pass);
+    std::vector<xt::xarray<T>> results;
+    results.reserve(inputs.size());
+    for (const auto& input : inputs) {
+        results.push_back(pass.result(*input->gradEdge()));
+    }
+    return results;
+}
+
+// Jacobians of output with respect to each input, [output size, input
+// shape], from one batched pass seeded with the identity.
+template <typename T>
+std::vector<xt::xarray<T>> jacobian(const std::shared_ptr<gradTensor<T>>& output,
+                                    const std::vector<std::shared_ptr<gradTensor<T>>>& inputs,
+                                    bool retainGraph = false) {
+    const auto& shape = output->getData().shape();
+    const size_t n = output->getData().size();
+    std::vector<size_t> seedShape{n};
+    seedShape.insert(seedShape.end(), shape.begin(), shape.end());
+    xt::xarray<T> seeds = xt::zeros<T>(seedShape);
+    for (size_t i = 0; i < n; ++i) {
+        seeds.data()[i * n + i] = T(1);
+    }
+    return backwardBatch(output, seeds, inputs, retainGraph);
+}
+
+// ===================== Backward Kernels =====================
+// Single-pass loops over contiguous buffers that write straight into the
+// operands' gradient buffers. Each variant is branch-free with
+// non-aliasing outputs, so the compiler vectorizes it; large buffers are
+// split across the pool by parallelFor.
+template <bool Acc, typename T, class F>
+void gradientLoop(size_t begin, size_t end, T* __restrict out, const F& contrib) {
+    for (size_t i = begin; i < end; ++i) {
+        T c = contrib(i);
+        out[i] = Acc ? T(out[i] + c) : c;
+    }
+}
+
+template <typename T, class F>
+void gradientLoop(size_t n, T* out, bool fresh, const F& contrib) {
+    parallelFor(n, [&](size_t begin, size_t end) {
+        if (fresh) {
+            gradientLoop<false>(begin, end, out, contrib);
+        } else {
+            gradientLoop<true>(begin, end, out, contrib);
+        }
+    });
+}
+
+// contrib(i, ca, cb) produces both operands' contributions for element i,
+// so the shared inputs are read once.
+template <bool AccA, bool AccB, typename T, class F>
+void gradientPairLoop(size_t begin, size_t end, T* __restrict outA, T* __restrict outB,
+                      const F& contrib) {
+    for (size_t i = begin; i < end; ++i) {
+        T ca, cb;
+        contrib(i, ca, cb);
+        outA[i] = AccA ? T(outA[i] + ca) : ca;
+        outB[i] = AccB ? T(outB[i] + cb) : cb;
+    }
+}
+
+template <typename T, class F>
+void gradientPairLoop(size_t n, T* outA, bool freshA, T* outB, bool freshB,
+                      const F& contrib) {
+    parallelFor(n, [&](size_t begin, size_t end) {
+        if (freshA && freshB) {
+            gradientPairLoop<false, false>(begin, end, outA, outB, contrib);
+        } else if (freshA) {
+            gradientPairLoop<false, true>(begin, end, outA, outB, contrib);
+        } else if (freshB) {
+            gradientPairLoop<true, false>(begin, end, outA, outB, contrib);
+        } else {
+            gradientPairLoop<true, true>(begin, end, outA, outB, contrib);
+        }
+    });
+}
+
+// ===================== GEMM =====================
+// Row-major C = alpha * op(A) * op(B) + beta * C, where op(X) is X or its
+// transpose. Transposition is folded into the indexing, so callers never
+// build a transposed copy. The portable kernel tiles M, K and N so each
+// block of B stays in cache while the rows of A stream past it. Build
+// with GRADTENSOR_USE_CBLAS (and link a CBLAS) to send float and double
+// products to the BLAS instead.
+constexpr size_t gemmBlockM = 64;
+constexpr size_t gemmBlockK = 128;
+constexpr size_t gemmBlockN = 256;
+
+template <typename T>
+void gemm(bool transA, bool transB, size_t M, size_t N, size_t K,
+          T alpha, const T* A, size_t lda, const T* B, size_t ldb,
+          T beta, T* C, size_t ldc) {
+    for (size_t i = 0; i < M; ++i) {
+        T* row = C + i * ldc;
+        for (size_t j = 0; j < N; ++j) {
+            // beta == 0 must not read C, which may be uninitialized.
+            row[j] = beta == T(0) ? T(0) : beta * row[j];
+        }
+    }
+    for (size_t i0 = 0; i0 < M; i0 += gemmBlockM) {
+        const size_t i1 = std::min(M, i0 + gemmBlockM);
+        for (size_t k0 = 0; k0 < K; k0 += gemmBlockK) {
+            const size_t k1 = std::min(K, k0 + gemmBlockK);
+            for (size_t j0 = 0; j0 < N; j0 += gemmBlockN) {
+                const size_t j1 = std::min(N, j0 + gemmBlockN);
+                for (size_t i = i0; i < i1; ++i) {
+                    T* __restrict row = C + i * ldc;
+                    for (size_t k = k0; k < k1; ++k) {
+                        const T a = alpha * (transA ? A[k * lda + i] : A[i * lda + k]);
+                        if (transB) {
+                            for (size_t j = j0; j < j1; ++j) {
+                                row[j] += a * B[j * ldb + k];
+                            }
+                        } else {
+                            const T* __restrict brow = B + k * ldb;
+                            for (size_t j = j0; j < j1; ++j) {
+                                row[j] += a * brow[j];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+#ifdef GRADTENSOR_USE_CBLAS
+inline void gemm(bool transA, bool transB, size_t M, size_t N, size_t K,
+                 float alpha, const float* A, size_t lda, const float* B, size_t ldb,
+                 float beta, float* C, size_t ldc) {
+    cblas_sgemm(CblasRowMajor, transA ? CblasTrans : CblasNoTrans,
+                transB ? CblasTrans : CblasNoTrans, int(M), int(N), int(K),
+                alpha, A, int(lda), B, int(ldb), beta, C, int(ldc));
+}
+
+inline void gemm(bool transA, bool transB, size_t M, size_t N, size_t K,
+                 double alpha, const double* A, size_t lda, const double* B, size_t ldb,
+                 double beta, double* C, size_t ldc) {
+    cblas_dgemm(CblasRowMajor, transA ? CblasTrans : CblasNoTrans,
+                transB ? CblasTrans : CblasNoTrans, int(M), int(N), int(K),
+                alpha, A, int(lda), B, int(ldb), beta, C, int(ldc));
+}
+#endif
+
+// bfloat16 products are widened to float once, so every dot product
+// accumulates in fp32 and only the result is rounded back.
+inline void gemm(bool transA, bool transB, size_t M, size_t N, size_t K,
+                 bfloat16 alpha, const bfloat16* A, size_t lda, const bfloat16* B, size_t ldb,
+                 bfloat16 beta, bfloat16* C, size_t ldc) {
+    const std::vector<float> a(A, A + (transA ? K : M) * lda);
+    const std::vector<float> b(B, B + (transB ? N : K) * ldb);
+    std::vector<float> c(M * ldc);
+    if (float(beta) != 0.0f) {
+        std::copy(C, C + M * ldc, c.begin());
+    }
+    gemm(transA, transB, M, N, K, float(alpha), a.data(), lda, b.data(), ldb,
+         float(beta), c.data(), ldc);
+    for (size_t i = 0; i < M; ++i) {
+        std::copy(c.begin() + i * ldc, c.begin() + i * ldc + N, C + i * ldc);
+    }
+}
+
+// ===================== Backward Ops =====================
+template <typename T, class C>
+class addBackward : public backop<T, C> {
+public:
+    addBackward(std::shared_ptr<gradNode<T, C>> a1, std::shared_ptr<gradNode<T, C>> a2) 
+        : backop<T, C>({std::move(a1), std::move(a2)}) {}
+
+    void backward(const C& accum_grad) override {
+        accumulateToShape(*this->inputs[0], accum_grad);
+        accumulateToShape(*this->inputs[1], accum_grad);
+    }
+
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T, C>& pass) override {
+        if constexpr (std::is_same<C, xt::xarray<T>>::value) {
+            pass.accumulate(*this->inputs[0], grads);
+            pass.accumulate(*this->inputs[1], grads);
+        } else {
+            backop<T, C>::backwardBatch(grads, pass);
+        }
+    }
+};
+
+template <typename T, class C>
+class subBackward : public backop<T, C> {
+public:
+    subBackward(std::shared_ptr<gradNode<T, C>> a1, std::shared_ptr<gradNode<T, C>> a2) 
+        : backop<T, C>({std::move(a1), std::move(a2)}) {}
+
+    void backward(const C& accum_grad) override {
+        accumulateToShape(*this->inputs[0], accum_grad);
+        if (this->inputs[1]->getShape() == accum_grad.shape()) {
+            this->inputs[1]->accumulate(T(-1), accum_grad);
+        } else {
+            accumulateToShape(*this->inputs[1], -accum_grad);
+        }
+    }
+
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T, C>& pass) override {
+        if constexpr (std::is_same<C, xt::xarray<T>>::value) {
+            pass.accumulate(*this->inputs[0], grads);
+            pass.accumulate(*this->inputs[1], -grads);
+        } else {
+            backop<T, C>::backwardBatch(grads, pass);
+        }
+    }
+};
+
+template <typename T, class C>
+class mulBackward : public backop<T, C> {
+    savedTensor<T, C> lhs, rhs;
+public:
+    mulBackward(const std::shared_ptr<gradTensor<T, C>>& a1,
+                const std::shared_ptr<gradTensor<T, C>>& a2)
+        : mulBackward(a1->gradEdge(), savedData(a1), a2->gradEdge(), savedData(a2)) {}
+    mulBackward(std::shared_ptr<gradNode<T, C>> a1, savedTensor<T, C> v1,
+                std::shared_ptr<gradNode<T, C>> a2, savedTensor<T, C> v2)
+        : backop<T, C>({std::move(a1), std::move(a2)}), lhs(std::move(v1)), rhs(std::move(v2)) {}
+
+    void releaseSaved() override {
+        lhs.reset();
+        rhs.reset();
+    }
+
+    void backward(const C& accum_grad) override {
+        const auto& arg1 = this->inputs[0];
+        const auto& arg2 = this->inputs[1];
+        if (lhs->shape() != accum_grad.shape() || rhs->shape() != accum_grad.shape()) {
+            accumulateToShape(*arg1, accum_grad * *rhs);
+            accumulateToShape(*arg2, accum_grad * *lhs);
+            return;
+        }
+        const size_t n = accum_grad.size();
+        const T* g = accum_grad.data();
+        const T* a = lhs->data();
+        const T* b = rhs->data();
+
+        if (arg1 == arg2) {
+            auto sa = arg1->gradientSink();
+            gradientLoop(n, sa.data, sa.fresh, [=](size_t i) { return T(2) * g[i] * a[i]; });
+            return;
+        }
+        auto [sa, sb] = gradNode<T, C>::gradientSinks(*arg1, *arg2);
+        gradientPairLoop(n, sa.data, sa.fresh, sb.data, sb.fresh, [=](size_t i, T& ca, T& cb) {
+            ca = g[i] * b[i];
+            cb = g[i] * a[i];
+        });
+    }
+
+    // The saved operands broadcast against the stack along its trailing axes.
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T, C>& pass) override {
+        if constexpr (std::is_same<C, xt::xarray<T>>::value) {
+            pass.accumulate(*this->inputs[0], grads * *rhs);
+            pass.accumulate(*this->inputs[1], grads * *lhs);
+        } else {
+            backop<T, C>::backwardBatch(grads, pass);
+        }
+    }
+};
+
+template <typename T, class C>
+class divBackward : public backop<T, C> {
+    savedTensor<T, C> lhs, rhs;
+public:
+    divBackward(const std::shared_ptr<gradTensor<T, C>>& a1,
+                const std::shared_ptr<gradTensor<T, C>>& a2)
+        : divBackward(a1->gradEdge(), savedData(a1), a2->gradEdge(), savedData(a2)) {}
+    divBackward(std::shared_ptr<gradNode<T, C>> a1, savedTensor<T, C> v1,
+                std::shared_ptr<gradNode<T, C>> a2, savedTensor<T, C> v2)
+        : backop<T, C>({std::move(a1), std::move(a2)}), lhs(std::move(v1)), rhs(std::move(v2)) {}
+
+    void releaseSaved() override {
+        lhs.reset();
+        rhs.reset();
+    }
+
+    void backward(const C& accum_grad) override {
+        const auto& arg1 = this->inputs[0];
+        const auto& arg2 = this->inputs[1];
+        if (lhs->shape() != accum_grad.shape() || rhs->shape() != accum_grad.shape()) {
+            accumulateToShape(*arg1, accum_grad / *rhs);
+            accumulateToShape(*arg2, -(accum_grad * *lhs) / (*rhs * *rhs));
+            return;
+        }
+        const size_t n = accum_grad.size();
+        const T* g = accum_grad.data();
+        const T* a = lhs->data();
+        const T* b = rhs->data();
+
+        if (arg1 == arg2) {
+            // d(a/a)/da vanishes, but the pass buffer still has to exist.
+            auto sa = arg1->gradientSink();
+            gradientLoop(n, sa.data, sa.fresh, [](size_t) { return T(0); });
+            return;
+        }
+        auto [sa, sb] = gradNode<T, C>::gradientSinks(*arg1, *arg2);
+        gradientPairLoop(n, sa.data, sa.fresh, sb.data, sb.fresh, [=](size_t i, T& ca, T& cb) {
+            T inv = T(1) / b[i];
+            ca = g[i] * inv;
+            cb = -(g[i] * a[i]) * inv * inv;
+        });
+    }
+
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T, C>& pass) override {
+        if constexpr (std::is_same<C, xt::xarray<T>>::value) {
+            pass.accumulate(*this->inputs[0], grads / *rhs);
+            pass.accumulate(*this->inputs[1], -(grads * *lhs) / (*rhs * *rhs));
+        } else {
+            backop<T, C>::backwardBatch(grads, pass);
+        }
+    }
+};
+
+// Gradients of C = op(A) * op(B) with respect to row-major A and B:
+//   dA = G * op(B)^T      (or op(B) * G^T when A is used transposed)
+//   dB = op(A)^T * G      (or G^T * op(A) when B is used transposed)
+// Each is written into out, assigned when fresh and accumulated otherwise.
+// g is M x N; with transA unset, M may span several stacked products.
+template <typename T, class C>
+void matmulGradLhs(const T* g, size_t M, size_t N, const C& a, const C& b, bool transA,
+                   bool transB, T* out, bool fresh) {
+    const size_t K = transA ? a.shape()[0] : a.shape()[1];
+    const size_t ldb = b.shape()[1];
+    if (transA) {
+        gemm(transB, true, K, M, N, T(1), b.data(), ldb, g, N,
+             fresh ? T(0) : T(1), out, M);
+    } else {
+        gemm(false, !transB, M, K, N, T(1), g, N, b.data(), ldb,
+             fresh ? T(0) : T(1), out, K);
+    }
+}
+
+template <typename T, class C>
+void matmulGradRhs(const T* g, size_t M, size_t N, const C& a, bool transA, bool transB,
+                   T* out, bool fresh) {
+    const size_t K = transA ? a.shape()[0] : a.shape()[1];
+    const size_t lda = a.shape()[1];
+    if (transB) {
+        gemm(true, transA, N, K, M, T(1), g, N, a.data(), lda,
+             fresh ? T(0) : T(1), out, K);
+    } else {
+        gemm(!transA, false, K, N, M, T(1), a.data(), lda, g, N,
+             fresh ? T(0) : T(1), out, N);
+    }
+}
+
+template <typename T, class C>
+void matmulGradLhs(const C& g, const C& a, const C& b, bool transA, bool transB,
+                   T* out, bool fresh) {
+    matmulGradLhs(g.data(), g.shape()[0], g.shape()[1], a, b, transA, transB, out, fresh);
+}
+
+template <typename T, class C>
+void matmulGradRhs(const C& g, const C& a, bool transA, bool transB, T* out, bool fresh) {
+    matmulGradRhs(g.data(), g.shape()[0], g.shape()[1], a, transA, transB, out, fresh);
+}
+
+// Stacked matmul gradients for grads [B, M, N]. Without transA the lhs
+// gradients of all B products form one [B * M, K] gemm; the rest run per
+// product.
+template <typename T>
+void matmulGradBatch(const xt::xarray<T>& grads, const xt::xarray<T>& a, const xt::xarray<T>& b,
+                     bool transA, bool transB, const gradNode<T>& lhs, const gradNode<T>& rhs,
+                     batchPass<T>& pass) {
+    const size_t B = grads.shape()[0];
+    const size_t M = grads.shape()[1];
+    const size_t N = grads.shape()[2];
+    const T* g = grads.data();
+    bool fresh;
+    T* ga = pass.sink(lhs, fresh);
+    if (!transA) {
+        matmulGradLhs(g, B * M, N, a, b, false, transB, ga, fresh);
+    } else {
+        for (size_t s = 0; s < B; ++s) {
+            matmulGradLhs(g + s * M * N, M, N, a, b, true, transB, ga + s * a.size(), fresh);
+        }
+    }
+    T* gb = pass.sink(rhs, fresh);
+    for (size_t s = 0; s < B; ++s) {
+        matmulGradRhs(g + s * M * N, M, N, a, transA, transB, gb + s * b.size(), fresh);
+    }
+}
+
+// Each product is written straight into the operand's pass buffer.
+template <typename T>
+class matmulBackward : public backop<T> {
+    savedTensor<T, xt::xarray<T>> lhs, rhs;
+    bool transA, transB;
+public:
+    matmulBackward(const std::shared_ptr<gradTensor<T>>& a1,
+                   const std::shared_ptr<gradTensor<T>>& a2, bool tA, bool tB)
+        : backop<T>({a1->gradEdge(), a2->gradEdge()}),
+          lhs(savedData(a1)), rhs(savedData(a2)), transA(tA), transB(tB) {}
+
+    void releaseSaved() override {
+        lhs.reset();
+        rhs.reset();
+    }
+
+    void backward(const xt::xarray<T>& accum_grad) override {
+        {
+            auto sa = this->inputs[0]->gradientSink();
+            matmulGradLhs(accum_grad, *lhs, *rhs, transA, transB, sa.data, sa.fresh);
+        }
+        auto sb = this->inputs[1]->gradientSink();
+        matmulGradRhs(accum_grad, *lhs, transA, transB, sb.data, sb.fresh);
+    }
+
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T>& pass) override {
+        matmulGradBatch(grads, *lhs, *rhs, transA, transB, *this->inputs[0], *this->inputs[1], pass);
+    }
+};
+
+// ===================== Tape Records =====================
+// Flat op format for gradTape: out = op(lhs, rhs, aux), with tensors
+// addressed by slot index. Operands an op does not use repeat lhs.
+enum class tapeOp : uint8_t {
+    add, sub, mul, div, matmul,
+    relu, tanh, sigmoid, exp, log,
+    linear, softmaxCrossEntropy
+};
+
+inline const char* tapeOpName(tapeOp op) {
+    switch (op) {
+    case tapeOp::add: return "add";
+    case tapeOp::sub: return "sub";
+    case tapeOp::mul: return "mul";
+    case tapeOp::div: return "div";
+    case tapeOp::matmul: return "matmul";
+    case tapeOp::relu: return "relu";
+    case tapeOp::tanh: return "tanh";
+    case tapeOp::sigmoid: return "sigmoid";
+    case tapeOp::exp: return "exp";
+    case tapeOp::log: return "log";
+    case tapeOp::linear: return "linear";
+    case tapeOp::softmaxCrossEntropy: return "softmaxCrossEntropy";
+    }
+    return "unknown";
+}
+
+struct tapeRecord {
+    tapeOp op;
+    // Recorded with grad mode enabled; backward skips the others.
+    bool requiresGrad;
+    bool transA, transB;
+    // aux is linear's bias.
+    uint32_t lhs, rhs, aux, out;
+};
+
+// ===================== Operator Overloads =====================
+// Records how ret was produced: in grad mode as a backop on its node, and
+// on the active tape if there is one. A tape capturing without the graph
+// takes the backop's place.
+template <typename T, class C, class MakeOp>
+void recordOp(tapeOp op, const std::shared_ptr<gradTensor<T, C>>& first,
+              const std::shared_ptr<gradTensor<T, C>>& second,
+              const std::shared_ptr<gradTensor<T, C>>& ret, const MakeOp& makeOp,
+              bool transA = false, bool transB = false,
+              const std::shared_ptr<gradTensor<T, C>>& aux = nullptr) {
+    gradTape<T, C>* tape = gradTape<T, C>::active();
+    if (gradMode::isEnabled() && (!tape || gradTape<T, C>::buildsGraph())) {
+        ret->setSource(makeOp());
+    }
+    if (tape) {
+        tape->record(op, first, second, ret, transA, transB, aux);
+    }
+    GRADTENSOR_PROFILE_RESULT(ret);
+}
+
+template <typename T, class C>
+typename C::shape_type resultShape(const std::shared_ptr<gradTensor<T, C>>& first,
+                                   const std::shared_ptr<gradTensor<T, C>>& second,
+                                   const char* symbol) {
+    if constexpr (isFixedContainer<C>::value) {
+        return first->getData().shape();
+    } else {
+        typename C::shape_type shape{};
+        if (!broadcastShape(first->getData().shape(), second->getData().shape(), shape)) {
+            throw std::invalid_argument(std::string("Shape mismatch for ") + symbol);
+        }
+        return shape;
+    }
+}
+
+// Writes op(a, b) into out, which has the broadcast shape. When neither
+// operand is broadcast, the flat buffers line up and large ones are split
+// across the pool; otherwise xtensor's broadcasting assignment runs.
+template <class C, class Op>
+void assignElementwise(C& out, const C& a, const C& b, Op op) {
+    if (a.size() != out.size() || b.size() != out.size()) {
+        xt::noalias(out) = op(a, b);
+        return;
+    }
+    using T = typename C::value_type;
+    T* __restrict o = out.data();
+    const T* pa = a.data();
+    const T* pb = b.data();
+    parallelFor(out.size(), [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            o[i] = op(pa[i], pb[i]);
+        }
+    });
+}
+
+// out = op(out, b) in place, with b broadcast to out's shape.
+template <class C, class Op>
+void updateElementwise(C& out, const C& b, Op op) {
+    if (b.size() != out.size()) {
+        xt::noalias(out) = op(out, b);
+        return;
+    }
+    using T = typename C::value_type;
+    T* o = out.data();
+    const T* pb = b.data();
+    parallelFor(out.size(), [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            o[i] = op(o[i], pb[i]);
+        }
+    });
+}
+
+template <class Op>
+struct flippedOp {
+    Op op;
+    template <class A, class B>
+    auto operator()(const A& a, const B& b) const { return op(b, a); }
+};
+
+// The values of op(first, second). An operand passed as an rvalue that
+// nothing else refers to, typically a temporary, and that already has the
+// result's shape gives up its buffer for them instead of a new one being
+// acquired. That is ruled out when the backop will read the operands
+// (saves), a tape holds on to them, or both operands are the same object,
+// as in std::move(x) + x. The operand gets its node first, so the gradient
+// edge keeps the right shape.
+template <typename T, class C, class Op>
+C elementwiseValues(const std::shared_ptr<gradTensor<T, C>>& first, bool firstTemporary,
+                    const std::shared_ptr<gradTensor<T, C>>& second, bool secondTemporary,
+                    const char* symbol, Op op, bool saves) {
+    const auto shape = resultShape(first, second, symbol);
+    if constexpr (!isFixedContainer<C>::value) {
+        const bool recording = gradMode::isEnabled();
+        if (!gradTape<T, C>::active() && !(recording && saves) && first.get() != second.get()) {
+            auto reuse = [&](const std::shared_ptr<gradTensor<T, C>>& operand,
+                             bool temporary) -> C* {
+                if (!temporary || operand.use_count() != 1 ||
+                    operand->getData().shape() != shape) {
+                    return nullptr;
+                }
+                if (recording) {
+                    operand->gradEdge();
+                }
+                return &operand->mutableData();
+            };
+            if (C* buf = reuse(first, firstTemporary)) {
+                C out = std::move(*buf);
+                updateElementwise(out, second->getData(), op);
+                return out;
+            }
+            if (C* buf = reuse(second, secondTemporary)) {
+                C out = std::move(*buf);
+                updateElementwise(out, first->getData(), flippedOp<Op>{op});
+                return out;
+            }
+        }
+    }
+    C out = bufferPool<C>::acquire(shape);
+    assignElementwise(out, first->getData(), second->getData(), op);
+    return out;
+}
+
+// The binary operators take their operands by forwarding reference: no
+// reference count traffic per call, and an rvalue operand can be told apart
+// as a candidate for buffer reuse. Both operands must be the same tensor
+// pointer type.
+template <class P>
+struct tensorOperand : std::false_type {};
+
+template <typename T, class C>
+struct tensorOperand<std::shared_ptr<gradTensor<T, C>>> : std::true_type {
+    using value_type = T;
+    using container_type = C;
+};
+
+template <class L, class R>
+using tensorResult = std::enable_if_t<tensorOperand<std::decay_t<L>>::value &&
+                                          std::is_same<std::decay_t<L>, std::decay_t<R>>::value,
+                                      std::decay_t<L>>;
+
+template <class L, class R>
+tensorResult<L, R> operator+(L&& first, R&& second) {
+    GRADTENSOR_PROFILE_FORWARD(tapeOpName(tapeOp::add));
+    using T = typename tensorOperand<std::decay_t<L>>::value_type;
+    using C = typename tensorOperand<std::decay_t<L>>::container_type;
+    auto ret = makeGraphObject<gradTensor<T, C>>(
+        elementwiseValues(first, !std::is_lvalue_reference<L>::value, second,
+                          !std::is_lvalue_reference<R>::value, "+", std::plus<>(), false));
+    recordOp(tapeOp::add, first, second, ret, [&] {
+        return makeGraphObject<addBackward<T, C>>(first->gradEdge(), second->gradEdge());
+    });
+    return ret;
+}
+
+template <class L, class R>
+tensorResult<L, R> operator-(L&& first, R&& second) {
+    GRADTENSOR_PROFILE_FORWARD(tapeOpName(tapeOp::sub));
+    using T = typename tensorOperand<std::decay_t<L>>::value_type;
+    using C = typename tensorOperand<std::decay_t<L>>::container_type;
+    auto ret = makeGraphObject<gradTensor<T, C>>(
+        elementwiseValues(first, !std::is_lvalue_reference<L>::value, second,
+                          !std::is_lvalue_reference<R>::value, "-", std::minus<>(), false));
+    recordOp(tapeOp::sub, first, second, ret, [&] {
+        return makeGraphObject<subBackward<T, C>>(first->gradEdge(), second->gradEdge());
+    });
+    return ret;
+}
+
+template <class L, class R>
+tensorResult<L, R> operator*(L&& first, R&& second) {
+    GRADTENSOR_PROFILE_FORWARD(tapeOpName(tapeOp::mul));
+    using T = typename tensorOperand<std::decay_t<L>>::value_type;
+    using C = typename tensorOperand<std::decay_t<L>>::container_type;
+    auto ret = makeGraphObject<gradTensor<T, C>>(
+        elementwiseValues(first, !std::is_lvalue_reference<L>::value, second,
+                          !std::is_lvalue_reference<R>::value, "*", std::multiplies<>(), true));
+    recordOp(tapeOp::mul, first, second, ret, [&] {
+        return makeGraphObject<mulBackward<T, C>>(first, second);
+    });
+    return ret;
+}
+
+template <class L, class R>
+tensorResult<L, R> operator/(L&& first, R&& second) {
+    GRADTENSOR_PROFILE_FORWARD(tapeOpName(tapeOp::div));
+    using T = typename tensorOperand<std::decay_t<L>>::value_type;
+    using C = typename tensorOperand<std::decay_t<L>>::container_type;
+    auto ret = makeGraphObject<gradTensor<T, C>>(
+        elementwiseValues(first, !std::is_lvalue_reference<L>::value, second,
+                          !std::is_lvalue_reference<R>::value, "/", std::divides<>(), true));
+    recordOp(tapeOp::div, first, second, ret, [&] {
+        return makeGraphObject<divBackward<T, C>>(first, second);
+    });
+    return ret;
+}
+
+// In-place variants, writing into first's buffer; second has to broadcast
+// to first's shape. Every one bumps first's version. With grad mode off
+// only the values change and first keeps its node and any gradient in it,
+// which is how parameters are updated. In grad mode first is rebased onto
+// the op. *= and /= read first's old values in backward, so those move to
+// a tensor of their own for the backop and first takes a new buffer.
+template <typename T, class C, class Op, class MakeOp>
+const std::shared_ptr<gradTensor<T, C>>& updateInPlace(
+    const std::shared_ptr<gradTensor<T, C>>& first, const std::shared_ptr<gradTensor<T, C>>& second,
+    const char* symbol, Op op, bool saves, const MakeOp& makeOp) {
+    GRADTENSOR_PROFILE_FORWARD(symbol);
+    if (gradTape<T, C>::active()) {
+        throw std::logic_error("In-place operations cannot be recorded on a gradTape");
+    }
+    if constexpr (!isFixedContainer<C>::value) {
+        if (resultShape(first, second, symbol) != first->getData().shape()) {
+            throw std::invalid_argument(std::string("In-place ") + symbol +
+                                        " cannot broadcast its target");
+        }
+    }
+    if (!gradMode::isEnabled()) {
+        updateElementwise(first->mutableData(), second->getData(), op);
+        return first;
+    }
+    auto lhsEdge = first->gradEdge();
+    auto rhsEdge = second->gradEdge();
+    if (!saves) {
+        updateElementwise(first->mutableData(), second->getData(), op);
+        first->rebase(makeOp(std::move(lhsEdge), savedTensor<T, C>(), std::move(rhsEdge),
+                             savedTensor<T, C>()));
+        return first;
+    }
+    auto old = makeGraphObject<gradTensor<T, C>>(std::move(first->mutableData()));
+    const auto& rhs = first == second ? old : second;
+    C& out = first->mutableData();
+    out = bufferPool<C>::acquire(old->getData().shape());
+    assignElementwise(out, old->getData(), rhs->getData(), op);
+    first->rebase(makeOp(std::move(lhsEdge), savedData(old), std::move(rhsEdge), savedData(rhs)));
+    return first;
+}
+
+template <typename T, class C>
+const std::shared_ptr<gradTensor<T, C>>& operator+=(
+    const std::shared_ptr<gradTensor<T, C>>& first,
+    const std::shared_ptr<gradTensor<T, C>>& second) {
+    return updateInPlace(first, second, "+=", std::plus<>(), false, [](auto a, auto, auto b, auto) {
+        return makeGraphObject<addBackward<T, C>>(std::move(a), std::move(b));
+    });
+}
+
+template <typename T, class C>
+const std::shared_ptr<gradTensor<T, C>>& operator-=(
+    const std::shared_ptr<gradTensor<T, C>>& first,
+    const std::shared_ptr<gradTensor<T, C>>& second) {
+    return updateInPlace(first, second, "-=", std::minus<>(), false,
+                         [](auto a, auto, auto b, auto) {
+        return makeGraphObject<subBackward<T, C>>(std::move(a), std::move(b));
+    });
+}
+
+template <typename T, class C>
+const std::shared_ptr<gradTensor<T, C>>& operator*=(
+    const std::shared_ptr<gradTensor<T, C>>& first,
+    const std::shared_ptr<gradTensor<T, C>>& second) {
+    return updateInPlace(first, second, "*=", std::multiplies<>(), true,
+                         [](auto a, auto va, auto b, auto vb) {
+        return makeGraphObject<mulBackward<T, C>>(std::move(a), std::move(va), std::move(b),
+                                                  std::move(vb));
+    });
+}
+
+template <typename T, class C>
+const std::shared_ptr<gradTensor<T, C>>& operator/=(
+    const std::shared_ptr<gradTensor<T, C>>& first,
+    const std::shared_ptr<gradTensor<T, C>>& second) {
+    return updateInPlace(first, second, "/=", std::divides<>(), true,
+                         [](auto a, auto va, auto b, auto vb) {
+        return makeGraphObject<divBackward<T, C>>(std::move(a), std::move(va), std::move(b),
+                                                  std::move(vb));
+    });
+}
+
+// Matrix product of two 2-D tensors. transA / transB use an operand as
+// its transpose without materializing it.
+template <typename T>
+std::shared_ptr<gradTensor<T>> matmul(const std::shared_ptr<gradTensor<T>>& first,
+                                      const std::shared_ptr<gradTensor<T>>& second,
+                                      bool transA = false, bool transB = false) {
+    GRADTENSOR_PROFILE_FORWARD(tapeOpName(tapeOp::matmul));
+    const auto& a = first->getData();
+    const auto& b = second->getData();
+    if (a.dimension() != 2 || b.dimension() != 2) {
+        throw std::invalid_argument("matmul expects 2-D operands");
+    }
+    const size_t M = transA ? a.shape()[1] : a.shape()[0];
+    const size_t K = transA ? a.shape()[0] : a.shape()[1];
+    const size_t N = transB ? b.shape()[0] : b.shape()[1];
+    if ((transB ? b.shape()[1] : b.shape()[0]) != K) {
+        throw std::invalid_argument("Shape mismatch for matmul");
+    }
+    xt::xarray<T> newData = bufferPool<xt::xarray<T>>::acquire(std::vector<size_t>{M, N});
+    gemm(transA, transB, M, N, K, T(1), a.data(), a.shape()[1],
+         b.data(), b.shape()[1], T(0), newData.data(), N);
+    auto ret = makeGraphObject<gradTensor<T>>(std::move(newData));
+    recordOp(tapeOp::matmul, first, second, ret, [&] {
+        return makeGraphObject<matmulBackward<T>>(first, second, transA, transB);
+    }, transA, transB);
+    return ret;
+}
+
+// ===================== Composite Ops =====================
+// Layers that would otherwise take a chain of elementwise nodes, each with
+// its own result, gradient buffer and backop. Every composite stores a
+// single backop and runs one forward and one backward kernel. The kernels
+// are shared with gradTape.
+
+// Activations: value(x), and the derivative expressed in x, so that
+// backward only needs the saved input.
+struct reluAct {
+    static constexpr tapeOp op = tapeOp::relu;
+    template <typename T>
+    static T value(T x) { return x > T(0) ? x : T(0); }
+    template <typename T>
+    static T derivative(T x) { return x > T(0) ? T(1) : T(0); }
+};
+
+struct tanhAct {
+    static constexpr tapeOp op = tapeOp::tanh;
+    template <typename T>
+    static T value(T x) { return std::tanh(x); }
+    template <typename T>
+    static T derivative(T x) {
+        T y = std::tanh(x);
+        return T(1) - y * y;
+    }
+};
+
+struct sigmoidAct {
+    static constexpr tapeOp op = tapeOp::sigmoid;
+    template <typename T>
+    static T value(T x) { return T(1) / (T(1) + std::exp(-x)); }
+    template <typename T>
+    static T derivative(T x) {
+        T y = value(x);
+        return y * (T(1) - y);
+    }
+};
+
+struct expAct {
+    static constexpr tapeOp op = tapeOp::exp;
+    template <typename T>
+    static T value(T x) { return std::exp(x); }
+    template <typename T>
+    static T derivative(T x) { return std::exp(x); }
+};
+
+struct logAct {
+    static constexpr tapeOp op = tapeOp::log;
+    template <typename T>
+    static T value(T x) { return std::log(x); }
+    template <typename T>
+    static T derivative(T x) { return T(1) / x; }
+};
+
+template <class Act, class C>
+void activationForward(C& out, const C& x) {
+    using T = typename C::value_type;
+    T* __restrict o = out.data();
+    const T* px = x.data();
+    parallelFor(x.size(), [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            o[i] = Act::value(px[i]);
+        }
+    });
+}
+
+template <class Act, typename T>
+void activationGrad(size_t n, const T* g, const T* x, T* out, bool fresh) {
+    gradientLoop(n, out, fresh, [=](size_t i) { return g[i] * Act::derivative(x[i]); });
+}
+
+// out = x * w + b for x [M, K], w [K, N] and b [N]. The rows of out start
+// as b and the product is accumulated on top by one gemm.
+template <typename T>
+void linearForward(size_t M, size_t K, size_t N, const T* x, const T* w, const T* b,
+                   T* out) {
+    for (size_t m = 0; m < M; ++m) {
+        std::copy(b, b + N, out + m * N);
+    }
+    gemm(false, false, M, N, K, T(1), x, K, w, N, T(1), out, N);
+}
+
+// Column sums of g [M, N], the bias gradient of linear.
+template <typename T>
+void biasGrad(size_t M, size_t N, const T* g, T* out, bool fresh) {
+    using A = typename accumulatorType<T>::type;
+    if constexpr (!std::is_same<A, T>::value) {
+        std::vector<A> sums(N, A(0));
+        for (size_t m = 0; m < M; ++m) {
+            const T* row = g + m * N;
+            for (size_t n = 0; n < N; ++n) {
+                sums[n] += A(row[n]);
+            }
+        }
+        for (size_t n = 0; n < N; ++n) {
+            out[n] = fresh ? T(sums[n]) : T(A(out[n]) + sums[n]);
+        }
+        return;
+    }
+    size_t m = 0;
+    if (fresh) {
+        std::copy(g, g + N, out);
+        m = 1;
+    }
+    for (; m < M; ++m) {
+        const T* row = g + m * N;
+        for (size_t n = 0; n < N; ++n) {
+            out[n] += row[n];
+        }
+    }
+}
+
+// Mean over M rows of -sum_k t[k] * log softmax(z)[k], for logits z and
+// target distributions t of shape [M, K]. Rows are shifted by their
+// log-sum-exp, so large logits cannot overflow.
+template <typename T>
+typename accumulatorType<T>::type logSumExp(const T* z, size_t K) {
+    using A = typename accumulatorType<T>::type;
+    const A top = A(*std::max_element(z, z + K));
+    A sum = A(0);
+    for (size_t k = 0; k < K; ++k) {
+        sum += std::exp(A(z[k]) - top);
+    }
+    return top + std::log(sum);
+}
+
+template <typename T>
+T softmaxCrossEntropyForward(size_t M, size_t K, const T* z, const T* t) {
+    using A = typename accumulatorType<T>::type;
+    A loss = A(0);
+    for (size_t m = 0; m < M; ++m) {
+        const T* zm = z + m * K;
+        const T* tm = t + m * K;
+        const A lse = logSumExp(zm, K);
+        for (size_t k = 0; k < K; ++k) {
+            loss -= A(tm[k]) * (A(zm[k]) - lse);
+        }
+    }
+    return T(loss / A(M));
+}
+
+// For an upstream gradient g of the loss:
+//   dz = g / M * (softmax(z) * sum_k t - t)
+//   dt = -g / M * log softmax(z)
+template <typename T>
+void softmaxCrossEntropyGrad(size_t M, size_t K, const T* z, const T* t, T g,
+                             T* dz, bool freshZ, T* dt, bool freshT) {
+    using A = typename accumulatorType<T>::type;
+    const A scale = A(g) / A(M);
+    for (size_t m = 0; m < M; ++m) {
+        const T* zm = z + m * K;
+        const T* tm = t + m * K;
+        const A lse = logSumExp(zm, K);
+        A mass = A(0);
+        for (size_t k = 0; k < K; ++k) {
+            mass += A(tm[k]);
+        }
+        for (size_t k = 0; k < K; ++k) {
+            const A logp = A(zm[k]) - lse;
+            const A cz = scale * (std::exp(logp) * mass - A(tm[k]));
+            const A ct = -scale * logp;
+            const size_t i = m * K + k;
+            dz[i] = freshZ ? T(cz) : T(A(dz[i]) + cz);
+            dt[i] = freshT ? T(ct) : T(A(dt[i]) + ct);
+        }
+    }
+}
+
+template <typename T, class C, class Act>
+class activationBackward : public backop<T, C> {
+    savedTensor<T, C> input;
+public:
+    explicit activationBackward(const std::shared_ptr<gradTensor<T, C>>& a)
+        : backop<T, C>({a->gradEdge()}), input(savedData(a)) {}
+
+    void releaseSaved() override { input.reset(); }
+
+    void backward(const C& accum_grad) override {
+        auto s = this->inputs[0]->gradientSink();
+        activationGrad<Act>(accum_grad.size(), accum_grad.data(), input->data(), s.data, s.fresh);
+    }
+
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T, C>& pass) override {
+        bool fresh;
+        T* out = pass.sink(*this->inputs[0], fresh);
+        const size_t n = input->size();
+        for (size_t s = 0; s < pass.size(); ++s) {
+            activationGrad<Act>(n, grads.data() + s * n, input->data(), out + s * n, fresh);
+        }
+    }
+};
+
+template <typename T>
+class linearBackward : public backop<T> {
+    savedTensor<T, xt::xarray<T>> x, w;
+public:
+    linearBackward(const std::shared_ptr<gradTensor<T>>& a,
+                   const std::shared_ptr<gradTensor<T>>& weight,
+                   const std::shared_ptr<gradTensor<T>>& bias)
+        : backop<T>({a->gradEdge(), weight->gradEdge(), bias->gradEdge()}),
+          x(savedData(a)), w(savedData(weight)) {}
+
+    void releaseSaved() override {
+        x.reset();
+        w.reset();
+    }
+
+    void backward(const xt::xarray<T>& accum_grad) override {
+        {
+            auto sx = this->inputs[0]->gradientSink();
+            matmulGradLhs(accum_grad, *x, *w, false, false, sx.data, sx.fresh);
+        }
+        {
+            auto sw = this->inputs[1]->gradientSink();
+            matmulGradRhs(accum_grad, *x, false, false, sw.data, sw.fresh);
+        }
+        auto sb = this->inputs[2]->gradientSink();
+        biasGrad(accum_grad.shape()[0], accum_grad.shape()[1], accum_grad.data(),
+                 sb.data, sb.fresh);
+    }
+
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T>& pass) override {
+        matmulGradBatch(grads, *x, *w, false, false, *this->inputs[0], *this->inputs[1], pass);
+        const size_t M = grads.shape()[1];
+        const size_t N = grads.shape()[2];
+        bool fresh;
+        T* out = pass.sink(*this->inputs[2], fresh);
+        for (size_t s = 0; s < pass.size(); ++s) {
+            biasGrad(M, N, grads.data() + s * M * N, out + s * N, fresh);
+        }
+    }
+};
+
+template <typename T>
+class softmaxCrossEntropyBackward : public backop<T> {
+    savedTensor<T, xt::xarray<T>> logits, targets;
+public:
+    softmaxCrossEntropyBackward(const std::shared_ptr<gradTensor<T>>& z,
+                                const std::shared_ptr<gradTensor<T>>& t)
+        : backop<T>({z->gradEdge(), t->gradEdge()}),
+          logits(savedData(z)), targets(savedData(t)) {}
+
+    void releaseSaved() override {
+        logits.reset();
+        targets.reset();
+    }
+
+    void backward(const xt::xarray<T>& accum_grad) override {
+        auto [sz, st] = gradNode<T>::gradientSinks(*this->inputs[0], *this->inputs[1]);
+        softmaxCrossEntropyGrad(logits->shape()[0], logits->shape()[1], logits->data(),
+                                targets->data(), accum_grad.data()[0],
+                                sz.data, sz.fresh, st.data, st.fresh);
+    }
+
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T>& pass) override {
+        bool freshZ, freshT;
+        T* dz = pass.sink(*this->inputs[0], freshZ);
+        T* dt = pass.sink(*this->inputs[1], freshT);
+        const size_t n = logits->size();
+        for (size_t s = 0; s < pass.size(); ++s) {
+            softmaxCrossEntropyGrad(logits->shape()[0], logits->shape()[1], logits->data(),
+                                    targets->data(), grads.data()[s],
+                                    dz + s * n, freshZ, dt + s * n, freshT);
+        }
+    }
+};
+
+template <class Act, typename T, class C>
+std::shared_ptr<gradTensor<T, C>> activation(const std::shared_ptr<gradTensor<T, C>>& input) {
+    GRADTENSOR_PROFILE_FORWARD(tapeOpName(Act::op));
+    const C& x = input->getData();
+    C newData = bufferPool<C>::acquire(x.shape());
+    activationForward<Act>(newData, x);
+    auto ret = makeGraphObject<gradTensor<T, C>>(std::move(newData));
+    recordOp(Act::op, input, input, ret, [&] {
+        return makeGraphObject<activationBackward<T, C, Act>>(input);
+    });
+    return ret;
+}
+
+template <typename T, class C>
+std::shared_ptr<gradTensor<T, C>> relu(const std::shared_ptr<gradTensor<T, C>>& x) {
+    return activation<reluAct>(x);
+}
+
+template <typename T, class C>
+std::shared_ptr<gradTensor<T, C>> tanh(const std::shared_ptr<gradTensor<T, C>>& x) {
+    return activation<tanhAct>(x);
+}
+
+template <typename T, class C>
+std::shared_ptr<gradTensor<T, C>> sigmoid(const std::shared_ptr<gradTensor<T, C>>& x) {
+    return activation<sigmoidAct>(x);
+}
+
+template <typename T, class C>
+std::shared_ptr<gradTensor<T, C>> exp(const std::shared_ptr<gradTensor<T, C>>& x) {
+    return activation<expAct>(x);
+}
+
+template <typename T, class C>
+std::shared_ptr<gradTensor<T, C>> log(const std::shared_ptr<gradTensor<T, C>>& x) {
+    return activation<logAct>(x);
+}
+
+// x [M, K] times weight [K, N] plus bias [N].
+template <typename T>
+std::shared_ptr<gradTensor<T>> linear(const std::shared_ptr<gradTensor<T>>& x,
+                                      const std::shared_ptr<gradTensor<T>>& weight,
+                                      const std::shared_ptr<gradTensor<T>>& bias) {
+    GRADTENSOR_PROFILE_FORWARD(tapeOpName(tapeOp::linear));
+    const auto& a = x->getData();
+    const auto& w = weight->getData();
+    const auto& b = bias->getData();
+    if (a.dimension() != 2 || w.dimension() != 2 || b.dimension() != 1 ||
+        a.shape()[1] != w.shape()[0] || b.shape()[0] != w.shape()[1]) {
+        throw std::invalid_argument("Shape mismatch for linear");
+    }
+    const size_t M = a.shape()[0];
+    const size_t K = a.shape()[1];
+    const size_t N = w.shape()[1];
+    xt::xarray<T> newData = bufferPool<xt::xarray<T>>::acquire(std::vector<size_t>{M, N});
+    linearForward(M, K, N, a.data(), w.data(), b.data(), newData.data());
+    auto ret = makeGraphObject<gradTensor<T>>(std::move(newData));
+    recordOp(tapeOp::linear, x, weight, ret, [&] {
+        return makeGraphObject<linearBackward<T>>(x, weight, bias);
+    }, false, false, bias);
+    return ret;
+}
+
+// Mean cross-entropy between softmax(logits) and target distributions, both
+// [M, K]; the result is a 0-d tensor.
+template <typename T>
+std::shared_ptr<gradTensor<T>> softmaxCrossEntropy(const std::shared_ptr<gradTensor<T>>& logits,
+                                                   const std::shared_ptr<gradTensor<T>>& targets) {
+    GRADTENSOR_PROFILE_FORWARD(tapeOpName(tapeOp::softmaxCrossEntropy));
+    const auto& z = logits->getData();
+    const auto& t = targets->getData();
+    if (z.dimension() != 2 || z.shape() != t.shape()) {
+        throw std::invalid_argument("Shape mismatch for softmaxCrossEntropy");
+    }
+    if (logits == targets) {
+        throw std::invalid_argument("softmaxCrossEntropy needs distinct logits and targets");
+    }
+    xt::xarray<T> newData = xt::xarray<T>::from_shape(std::vector<size_t>{});
+    newData.data()[0] = softmaxCrossEntropyForward(z.shape()[0], z.shape()[1], z.data(), t.data());
+    auto ret = makeGraphObject<gradTensor<T>>(std::move(newData));
+    recordOp(tapeOp::softmaxCrossEntropy, logits, targets, ret, [&] {
+        return makeGraphObject<softmaxCrossEntropyBackward<T>>(logits, targets);
+    });
+    return ret;
+}
+
+// ===================== Checkpointing =====================
+// A checkpointed segment keeps nothing of its interior alive between
+// forward and backward. Forward runs the segment with grad mode off and
+// records one node whose backop saves only the segment's inputs; when
+// backward reaches it, the backop reruns the segment on copies of those
+// inputs with grad mode on and backpropagates through the rebuilt graph.
+// Peak memory then grows with the largest segment rather than with the
+// whole graph, in exchange for a second forward of every segment. The
+// segment must compute the same values on both runs.
+template <typename T, class C>
+using segmentFn = std::function<std::shared_ptr<gradTensor<T, C>>(
+    const std::vector<std::shared_ptr<gradTensor<T, C>>>&)>;
+
+template <typename T, class C>
+class checkpointBackward : public backop<T, C> {
+    segmentFn<T, C> segment;
+    std::vector<savedTensor<T, C>> saved;
+
+public:
+    checkpointBackward(segmentFn<T, C> fn, const std::vector<std::shared_ptr<gradTensor<T, C>>>& in)
+        : backop<T, C>({}), segment(std::move(fn)) {
+        this->inputs.reserve(in.size());
+        saved.reserve(in.size());
+        for (const auto& t : in) {
+            this->inputs.push_back(t->gradEdge());
+            saved.push_back(savedData(t));
+        }
+    }
+
+    void releaseSaved() override {
+        saved.clear();
+        segment = nullptr;
+    }
+
+    void backward(const C& accum_grad) override {
+        std::vector<std::shared_ptr<gradTensor<T, C>>> leaves;
+        leaves.reserve(saved.size());
+        for (const auto& data : saved) {
+            leaves.push_back(std::make_shared<gradTensor<T, C>>(*data));
+        }
+        std::shared_ptr<gradTensor<T, C>> out;
+        {
+            enableGradGuard guard;
+            out = segment(leaves);
+        }
+        out->backward(accum_grad);
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            if (leaves[i]->hasGradient()) {
+                this->inputs[i]->accumulate(leaves[i]->getGrad());
+            }
+        }
+    }
+};
+
+// Runs fn(inputs) as a checkpointed segment. With grad mode off this is
+// just fn(inputs).
+template <typename T, class C = xt::xarray<T>, class F>
+std::shared_ptr<gradTensor<T, C>> checkpoint(
+    F fn, const std::vector<std::shared_ptr<gradTensor<T, C>>>& inputs) {
+    GRADTENSOR_PROFILE_FORWARD("checkpoint");
+    if (gradTape<T, C>::active()) {
+        throw std::logic_error("Checkpointed segments cannot be recorded on a gradTape");
+    }
+    if (!gradMode::isEnabled()) {
+        return fn(inputs);
+    }
+    segmentFn<T, C> segment = std::move(fn);
+    std::shared_ptr<gradTensor<T, C>> result;
+    {
+        noGradGuard guard;
+        result = segment(inputs);
+    }
+    // A fresh result gets the checkpoint node directly; one held elsewhere,
+    // such as an input the segment passed through, is copied.
+    if (result.use_count() != 1 || result->getSource()) {
+        result = makeGraphObject<gradTensor<T, C>>(result->getData());
+    }
+    result->setSource(makeGraphObject<checkpointBackward<T, C>>(std::move(segment), inputs));
+    GRADTENSOR_PROFILE_RESULT(result);
+    return result;
+}
+
+template <typename T, class C, class F>
+std::shared_ptr<gradTensor<T, C>> checkpoint(F fn, const std::shared_ptr<gradTensor<T, C>>& input) {
+    segmentFn<T, C> segment =
+        [fn = std::move(fn)](const std::vector<std::shared_ptr<gradTensor<T, C>>>& in) {
+            return fn(in[0]);
+        };
+    return checkpoint<T, C>(std::move(segment),
+                            std::vector<std::shared_ptr<gradTensor<T, C>>>{input});
+}
+
+// ===================== Mixed Precision =====================
+// The usual recipe for reduced precision: parameters stay fp32 leaves, cast
+// produces bfloat16 copies for the forward pass, and every activation and
+// its gradient is stored at half the size. The gradient crossing a cast is
+// widened back, so the parameters accumulate in fp32. lossScaler keeps
+// small gradients from flushing to zero on the way.
+//
+// In grad mode only leaves can be cast. The gradient then ends at the
+// cast, and a backward pass never continues into a graph of another
+// element type.
+template <typename U, typename T>
+class castBackward : public backop<U> {
+    std::shared_ptr<gradNode<T>> leaf;
+public:
+    explicit castBackward(std::shared_ptr<gradNode<T>> l) : backop<U>({}), leaf(std::move(l)) {}
+
+    void backward(const xt::xarray<U>& accum_grad) override {
+        xt::xarray<T> g = bufferPool<xt::xarray<T>>::acquire(accum_grad.shape());
+        std::copy(accum_grad.data(), accum_grad.data() + accum_grad.size(), g.data());
+        leaf->accumulateGrad(g);
+        bufferPool<xt::xarray<T>>::release(std::move(g));
+    }
+};
+
+// input converted to element type U, e.g. cast<bfloat16>(weights).
+template <typename U, typename T>
+std::shared_ptr<gradTensor<U>> cast(const std::shared_ptr<gradTensor<T>>& input) {
+    GRADTENSOR_PROFILE_FORWARD("cast");
+    if (gradTape<T>::active() || gradTape<U>::active()) {
+        throw std::logic_error("cast cannot be recorded on a gradTape");
+    }
+    if (gradMode::isEnabled() && input->getSource()) {
+        throw std::invalid_argument("cast in grad mode needs a leaf, not an op result");
+    }
+    const auto& x = input->getData();
+    xt::xarray<U> newData = bufferPool<xt::xarray<U>>::acquire(x.shape());
+    std::copy(x.data(), x.data() + x.size(), newData.data());
+    auto ret = makeGraphObject<gradTensor<U>>(std::move(newData));
+    if (gradMode::isEnabled()) {
+        ret->setSource(makeGraphObject<castBackward<U, T>>(input->gradEdge()));
+    }
+    GRADTENSOR_PROFILE_RESULT(ret);
+    return ret;
+}
+
+// Dynamic loss scaling. backward() seeds the pass with the current scale,
+// lifting gradients above the smallest bfloat16 magnitudes; unscale()
+// divides it back out of the parameters' gradients, and reports whether
+// all of them are finite. On overflow those gradients are zeroed, the
+// step should be skipped, and the scale backs off; every growthInterval
+// clean steps it grows again.
+class lossScaler {
+    double scale;
+    double growth;
+    double backoff;
+    size_t interval;
+    size_t clean = 0;
+public:
+    explicit lossScaler(double initial = 65536.0, double growthFactor = 2.0,
+                        double backoffFactor = 0.5, size_t growthInterval = 2000)
+        : scale(initial), growth(growthFactor), backoff(backoffFactor),
+          interval(growthInterval) {}
+
+    double getScale() const { return scale; }
+
+    template <typename T, class C>
+    void backward(const std::shared_ptr<gradTensor<T, C>>& loss, bool retainGraph = false) {
+        C seed = bufferPool<C>::acquire(loss->getData().shape());
+        seed.fill(T(scale));
+        loss->backward(seed, retainGraph);
+        bufferPool<C>::release(std::move(seed));
+    }
+
+    template <typename T, class C>
+    bool unscale(const std::vector<std::shared_ptr<gradTensor<T, C>>>& params) {
+        const T inverse = T(1.0 / scale);
+        bool finite = true;
+        for (const auto& p : params) {
+            if (!p->hasGradient()) {
+                continue;
+            }
+            p->gradEdge()->updateGrad([&](C& g) {
+                T* data = g.data();
+                for (size_t i = 0; i < g.size(); ++i) {
+                    data[i] *= inverse;
+                    finite = finite && std::isfinite(double(data[i]));
+                }
+            });
+        }
+        if (!finite) {
+            for (const auto& p : params) {
+                p->gradEdge()->updateGrad([](C& g) { g.fill(T(0)); });
+            }
+            scale *= backoff;
+            clean = 0;
+        } else if (++clean == interval) {
+            scale *= growth;
+            clean = 0;
+        }
+        return finite;
+    }
+};
+
+// ===================== Serialization =====================
+// Versioned binary files for tensors and tapes, in host byte order. A
+// tensor archive is a header, a table with each entry's dtype, shape and
+// buffer offsets, then the raw values (and gradients, if saved), each
+// buffer aligned to serialAlignment. Archives are opened by mapping the
+// file, so reading an entry is a zero-copy xt::adapt view, and processes
+// that map the same parameters share its pages.
+constexpr uint32_t serialVersion = 1;
+constexpr uint64_t serialAlignment = 64;
+
+inline uint64_t serialAligned(uint64_t offset) {
+    return (offset + serialAlignment - 1) / serialAlignment * serialAlignment;
+}
+
+template <typename T>
+struct serialType;
+
+template <>
+struct serialType<float> { static constexpr uint8_t code = 1; };
+
+template <>
+struct serialType<double> { static constexpr uint8_t code = 2; };
+
+template <>
+struct serialType<bfloat16> { static constexpr uint8_t code = 3; };
+
+// A whole file mapped copy-on-write: writes through a view touch only
+// this process's copy of the page, and pages never written stay shared
+// with the page cache.
+class mappedFile {
+    char* base = nullptr;
+    size_t length = 0;
+
+public:
+    explicit mappedFile(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot stat " + path);
+        }
+        length = static_cast<size_t>(info.st_size);
+        if (length > 0) {
+            void* p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Cannot map " + path);
+            }
+            base = static_cast<char*>(p);
+        }
+        ::close(fd);
+    }
+
+    ~mappedFile() {
+        if (base) {
+            ::munmap(base, length);
+        }
+    }
+
+    mappedFile(const mappedFile&) = delete;
+    mappedFile& operator=(const mappedFile&) = delete;
+
+    char* data() const { return base; }
+    size_t size() const { return length; }
+};
+
+// Sequential writer that tracks its offset, so buffers can be aligned.
+class binaryWriter {
+    std::ostream& out;
+    uint64_t offset = 0;
+
+public:
+    explicit binaryWriter(std::ostream& o) : out(o) {}
+
+    void bytes(const void* p, size_t n) {
+        out.write(static_cast<const char*>(p), static_cast<std::streamsize>(n));
+        if (!out) {
+            throw std::runtime_error("Writing a gradtensor file failed");
+        }
+        offset += n;
+    }
+
+    template <class V>
+    void value(const V& v) {
+        static_assert(std::is_trivially_copyable<V>::value,
+                      "Only plain values are written directly");
+        bytes(&v, sizeof(V));
+    }
+
+    void header(const char* magic) {
+        bytes(magic, 8);
+        value(serialVersion);
+    }
+
+    void shape(const std::vector<size_t>& s) {
+        value(static_cast<uint32_t>(s.size()));
+        for (size_t d : s) {
+            value(static_cast<uint64_t>(d));
+        }
+    }
+
+    void align() {
+        static const char zeros[serialAlignment] = {};
+        bytes(zeros, serialAligned(offset) - offset);
+    }
+
+    uint64_t position() const { return offset; }
+};
+
+// Bounds-checked reader over a mapped file.
+class binaryReader {
+    char* base;
+    size_t length;
+    uint64_t offset = 0;
+
+public:
+    explicit binaryReader(const mappedFile& file) : base(file.data()), length(file.size()) {}
+
+    char* at(uint64_t pos, uint64_t n) const {
+        if (pos > length || n > length - pos) {
+            throw std::runtime_error("gradtensor file is truncated");
+        }
+        return base + pos;
+    }
+
+    template <class V>
+    V value() {
+        V v;
+        std::memcpy(&v, at(offset, sizeof(V)), sizeof(V));
+        offset += sizeof(V);
+        return v;
+    }
+
+    // count elements of V at pos, which the format keeps aligned.
+    template <class V>
+    V* buffer(uint64_t pos, size_t count) const {
+        if (count > length / sizeof(V) || pos % alignof(V) != 0) {
+            throw std::runtime_error("gradtensor file has a corrupt buffer offset");
+        }
+        return reinterpret_cast<V*>(at(pos, count * sizeof(V)));
+    }
+
+    void header(const char* magic) {
+        if (std::memcmp(at(0, 8), magic, 8) != 0) {
+            throw std::runtime_error(std::string("Not a ") + std::string(magic, 8) + " file");
+        }
+        offset = 8;
+        const uint32_t version = value<uint32_t>();
+        if (version != serialVersion) {
+            throw std::runtime_error("Unsupported gradtensor file version " +
+                                     std::to_string(version));
+        }
+    }
+
+    // The shape and its element count, checked against the file size.
+    std::vector<size_t> shape(size_t& count) {
+        const uint32_t rank = value<uint32_t>();
+        std::vector<size_t> s;
+        count = 1;
+        for (uint32_t i = 0; i < rank; ++i) {
+            const uint64_t d = value<uint64_t>();
+            if (d != 0 && count > length / d) {
+                throw std::runtime_error("gradtensor file has a corrupt shape");
+            }
+            s.push_back(static_cast<size_t>(d));
+            count *= s.back();
+        }
+        return s;
+    }
+
+    void align() { offset = serialAligned(offset); }
+    void skip(uint64_t n) { offset += n; }
+    uint64_t position() const { return offset; }
+};
+
+template <class C>
+std::vector<size_t> shapeVector(const C& c) {
+    return std::vector<size_t>(c.shape().begin(), c.shape().end());
+}
+
+// Writes the tensors' values, and with withGrad the gradients of those
+// that have one, as a tensor archive.
+template <typename T, class C>
+void saveTensors(std::ostream& out, const std::vector<std::shared_ptr<gradTensor<T, C>>>& tensors,
+                 bool withGrad = true) {
+    std::vector<bool> grads;
+    uint64_t tableEnd = 16;
+    for (const auto& t : tensors) {
+        grads.push_back(withGrad && t->hasGradient());
+        tableEnd += 24 + 8 * t->getData().dimension();
+    }
+    binaryWriter w(out);
+    w.header("GRADTNSR");
+    w.value(static_cast<uint32_t>(tensors.size()));
+    uint64_t next = serialAligned(tableEnd);
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const uint64_t bytes = tensors[i]->getData().size() * sizeof(T);
+        w.value(serialType<T>::code);
+        w.value(static_cast<uint8_t>(grads[i]));
+        w.value(uint16_t(0));
+        w.shape(shapeVector(tensors[i]->getData()));
+        w.value(next);
+        next = serialAligned(next + bytes);
+        w.value(grads[i] ? next : uint64_t(0));
+        if (grads[i]) {
+            next = serialAligned(next + bytes);
+        }
+    }
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const C& data = tensors[i]->getData();
+        w.align();
+        w.bytes(data.data(), data.size() * sizeof(T));
+        if (grads[i]) {
+            w.align();
+            w.bytes(tensors[i]->getGrad().data(), data.size() * sizeof(T));
+        }
+    }
+}
+
+template <typename T, class C>
+void saveTensors(const std::string& path,
+                 const std::vector<std::shared_ptr<gradTensor<T, C>>>& tensors,
+                 bool withGrad = true) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Cannot create " + path);
+    }
+    saveTensors(out, tensors, withGrad);
+}
+
+// A mapped tensor archive. values() and grad() are views into the
+// mapping and valid while the archive is open; load() copies an entry
+// into a gradTensor of its own.
+template <typename T>
+class tensorArchive {
+    struct entry {
+        std::vector<size_t> shape;
+        size_t count;
+        T* values;
+        T* grad;
+    };
+
+    mappedFile file;
+    std::vector<entry> entries;
+
+    const entry& at(size_t i) const {
+        if (i >= entries.size()) {
+            throw std::out_of_range("Tensor archive has no entry " + std::to_string(i));
+        }
+        return entries[i];
+    }
+
+public:
+    explicit tensorArchive(const std::string& path) : file(path) {
+        binaryReader in(file);
+        in.header("GRADTNSR");
+        const uint32_t count = in.value<uint32_t>();
+        for (uint32_t i = 0; i < count; ++i) {
+            if (in.value<uint8_t>() != serialType<T>::code) {
+                throw std::runtime_error("Tensor archive holds a different element type");
+            }
+            const bool hasGrad = in.value<uint8_t>() != 0;
+            in.value<uint16_t>();
+            entry e;
+            e.shape = in.shape(e.count);
+            e.values = in.buffer<T>(in.value<uint64_t>(), e.count);
+            const uint64_t gradOffset = in.value<uint64_t>();
+            e.grad = hasGrad ? in.buffer<T>(gradOffset, e.count) : nullptr;
+            entries.push_back(std::move(e));
+        }
+    }
+
+    size_t size() const { return entries.size(); }
+    const std::vector<size_t>& shape(size_t i) const { return at(i).shape; }
+    bool hasGrad(size_t i) const { return at(i).grad != nullptr; }
+
+    auto values(size_t i) const {
+        const entry& e = at(i);
+        return xt::adapt(e.values, e.count, xt::no_ownership(), e.shape);
+    }
+
+    auto grad(size_t i) const {
+        const entry& e = at(i);
+        if (!e.grad) {
+            throw std::invalid_argument("Tensor archive entry " + std::to_string(i) +
+                                        " has no gradient");
+        }
+        return xt::adapt(e.grad, e.count, xt::no_ownership(), e.shape);
+    }
+
+    template <class C = xt::xarray<T>>
+    std::shared_ptr<gradTensor<T, C>> load(size_t i) const {
+        auto tensor = std::make_shared<gradTensor<T, C>>(values(i));
+        if (hasGrad(i)) {
+            tensor->gradEdge()->accumulateGrad(C(grad(i)));
+        }
+        return tensor;
+    }
+};
+
+// ===================== Graph Tape =====================
+// Flat storage of a graph as a Wengert list. While a tapeCapture is active,
+// each op on the thread is appended to a gradTape as a tapeRecord whose
+// operands are slots in the tape's tensor table. Tensors the tape did not
+// produce become input slots, and each op result gets a slot of its own.
+// Backward walks the records in reverse with a switch per op: there is no
+// pointer chasing, no virtual call and no per-edge heap object.
+//
+// A capture can also keep building the ordinary graph, or run with graph
+// = false so the tape is the only record of the ops. In that case no
+// gradNodes or backops are created, and tape.backward(output) backprops
+// over the live values.
+//
+// For steps that rebuild the same graph, finalize() fixes the output,
+// precomputes the backward order and preallocates every buffer. replay()
+// then reruns forward and backward over the records. It builds no tensors,
+// nodes or backops, and allocates nothing beyond the reductions of
+// broadcast gradients. A finalized tape can be written with save() and
+// read back, finalized, with load().
+//
+// Inputs are read from their tensors unless setInput() supplies new data
+// for a replay. Backward adds each input's gradient to its tensor, as an
+// eager pass would, and stops there. Lazy fused expressions cannot be
+// recorded.
+template <typename T, class C>
+class gradTape {
+public:
+    gradTape() = default;
+    gradTape(const gradTape&) = delete;
+    gradTape& operator=(const gradTape&) = delete;
+
+    ~gradTape() { clear(); }
+
+    static gradTape*& active() {
+        static thread_local gradTape* tape = nullptr;
+        return tape;
+    }
+
+    // Whether ops under the active tape also build the ordinary graph.
+    static bool& buildsGraph() {
+        static thread_local bool graph = true;
+        return graph;
+    }
+
+    void record(tapeOp op, const std::shared_ptr<gradTensor<T, C>>& lhs,
+                const std::shared_ptr<gradTensor<T, C>>& rhs,
+                const std::shared_ptr<gradTensor<T, C>>& out,
+                bool transA = false, bool transB = false,
+                const std::shared_ptr<gradTensor<T, C>>& aux = nullptr) {
+        if (finalized) {
+            throw std::logic_error("Recording into a gradTape that is already finalized");
+        }
+        const uint32_t a = slotOf(lhs);
+        tapeRecord r{op, gradMode::isEnabled(), transA, transB, a, slotOf(rhs),
+                     aux ? slotOf(aux) : a, 0};
+        r.out = static_cast<uint32_t>(slots.size());
+        slots.emplace_back();
+        // Holding every recorded tensor keeps its value for backward and
+        // the addresses in index unique.
+        slots.back().tensor = out;
+        index[out.get()] = r.out;
+        records.push_back(r);
+    }
+
+    // Reverse scan from output over the recorded values. Unless
+    // retainGraph is set the tape is cleared afterwards, ready for the
+    // next step.
+    void backward(const std::shared_ptr<gradTensor<T, C>>& output, bool retainGraph = false) {
+        if (finalized) {
+            throw std::logic_error("A finalized gradTape is run with replay()");
+        }
+        const uint32_t out = outputSlot(output);
+        beginPass(out);
+        for (size_t k = records.size(); k-- > 0;) {
+            backprop(records[k]);
+        }
+        finishPass();
+        if (!retainGraph) {
+            clear();
+        }
+    }
+
+    void finalize(const std::shared_ptr<gradTensor<T, C>>& output) {
+        if (finalized) {
+            throw std::logic_error("gradTape is already finalized");
+        }
+        root = outputSlot(output);
+        // From here on only inputs are looked up by tensor.
+        for (auto i = index.begin(); i != index.end();) {
+            i = slots[i->second].input ? std::next(i) : index.erase(i);
+        }
+        plan();
+        forwarded = true;
+    }
+
+    // Writes a finalized tape: its records, the shape of every slot and
+    // the current values of its inputs.
+    void save(std::ostream& out) const {
+        if (!finalized) {
+            throw std::logic_error("Only a finalized gradTape can be saved");
+        }
+        binaryWriter w(out);
+        w.header("GRADTAPE");
+        w.value(serialType<T>::code);
+        w.value(static_cast<uint32_t>(records.size()));
+        w.value(static_cast<uint32_t>(slots.size()));
+        w.value(root);
+        for (const tapeRecord& r : records) {
+            w.value(static_cast<uint8_t>(r.op));
+            w.value(static_cast<uint8_t>(r.requiresGrad));
+            w.value(static_cast<uint8_t>(r.transA));
+            w.value(static_cast<uint8_t>(r.transB));
+            w.value(r.lhs);
+            w.value(r.rhs);
+            w.value(r.aux);
+            w.value(r.out);
+        }
+        for (uint32_t i = 0; i < slots.size(); ++i) {
+            w.value(static_cast<uint8_t>(slots[i].input));
+            w.shape(shapeVector(valueOf(i)));
+        }
+        for (uint32_t i = 0; i < slots.size(); ++i) {
+            if (slots[i].input) {
+                const C& value = valueOf(i);
+                w.align();
+                w.bytes(value.data(), value.size() * sizeof(T));
+            }
+        }
+    }
+
+    void save(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot create " + path);
+        }
+        save(out);
+    }
+
+    // Replaces this tape with one written by save(), finalized and ready
+    // to replay. Each input gets a fresh tensor holding its saved values;
+    // inputs() returns them in slot order, for setInput() and for reading
+    // the gradients replay() adds to them. A truncated, corrupt or
+    // inconsistent file raises runtime_error.
+    void load(const std::string& path) {
+        mappedFile file(path);
+        binaryReader in(file);
+        in.header("GRADTAPE");
+        if (in.value<uint8_t>() != serialType<T>::code) {
+            throw std::runtime_error("gradTape file holds a different element type");
+        }
+        const uint32_t recordCount = in.value<uint32_t>();
+        const uint32_t slotCount = in.value<uint32_t>();
+        const uint32_t output = in.value<uint32_t>();
+        // Each record takes 20 bytes and each slot at least 5.
+        if (20 * uint64_t(recordCount) + 5 * uint64_t(slotCount) > file.size()) {
+            throw std::runtime_error("gradtensor file is truncated");
+        }
+        std::vector<tapeRecord> loaded;
+        for (uint32_t k = 0; k < recordCount; ++k) {
+            tapeRecord r;
+            const uint8_t op = in.value<uint8_t>();
+            if (op > static_cast<uint8_t>(tapeOp::softmaxCrossEntropy)) {
+                throw std::runtime_error("gradTape file has an unknown op");
+            }
+            r.op = static_cast<tapeOp>(op);
+            r.requiresGrad = in.value<uint8_t>() != 0;
+            r.transA = in.value<uint8_t>() != 0;
+            r.transB = in.value<uint8_t>() != 0;
+            r.lhs = in.value<uint32_t>();
+            r.rhs = in.value<uint32_t>();
+            r.aux = in.value<uint32_t>();
+            r.out = in.value<uint32_t>();
+            if (std::max({r.lhs, r.rhs, r.aux, r.out}) >= slotCount) {
+                throw std::runtime_error("gradTape file refers to a missing slot");
+            }
+            loaded.push_back(r);
+        }
+        std::vector<slot> table(slotCount);
+        std::vector<std::vector<size_t>> shapes(slotCount);
+        std::vector<size_t> counts(slotCount);
+        for (uint32_t i = 0; i < slotCount; ++i) {
+            table[i].input = in.value<uint8_t>() != 0;
+            shapes[i] = in.shape(counts[i]);
+        }
+        if (output >= slotCount || table[output].input) {
+            throw std::runtime_error("gradTape file has an invalid output slot");
+        }
+        checkRecords(loaded, table, shapes);
+        for (uint32_t i = 0; i < slotCount; ++i) {
+            if (!table[i].input) {
+                table[i].value = bufferPool<C>::acquire(shapes[i]);
+            }
+        }
+        for (uint32_t i = 0; i < slotCount; ++i) {
+            if (table[i].input) {
+                in.align();
+                const std::vector<size_t>& shape = shapes[i];
+                const size_t count = counts[i];
+                T* values = in.buffer<T>(in.position(), count);
+                table[i].tensor = std::make_shared<gradTensor<T, C>>(
+                    xt::adapt(values, count, xt::no_ownership(), shape));
+                in.skip(count * sizeof(T));
+            }
+        }
+        clear();
+        records = std::move(loaded);
+        slots = std::move(table);
+        for (uint32_t i = 0; i < slots.size(); ++i) {
+            if (slots[i].input) {
+                index.emplace(slots[i].tensor.get(), i);
+            }
+        }
+        root = output;
+        plan();
+        // Op results were not saved, so nothing reads them before forward().
+        forwarded = false;
+    }
+
+    std::vector<std::shared_ptr<gradTensor<T, C>>> inputs() const {
+        std::vector<std::shared_ptr<gradTensor<T, C>>> result;
+        for (const slot& s : slots) {
+            if (s.input) {
+                result.push_back(s.tensor);
+            }
+        }
+        return result;
+    }
+
+    // Replaces an input's data for subsequent replays.
+    void setInput(const std::shared_ptr<gradTensor<T, C>>& tensor, const C& data) {
+        auto it = index.find(tensor.get());
+        if (it == index.end() || !slots[it->second].input) {
+            throw std::invalid_argument("Tensor is not an input of this gradTape");
+        }
+        slot& s = slots[it->second];
+        const auto& shape = s.tensor->getData().shape();
+        if (data.dimension() != shape.size() ||
+            !std::equal(shape.begin(), shape.end(), data.shape().begin())) {
+            throw std::invalid_argument("setInput shape differs from the recorded shape");
+        }
+        if (!s.overridden) {
+            s.value = bufferPool<C>::acquire(shape);
+            s.overridden = true;
+        }
+        xt::noalias(s.value) = data;
+    }
+
+    void forward() {
+        requireFinalized();
+        for (const tapeRecord& r : records) {
+            GRADTENSOR_PROFILE_FORWARD(tapeOpName(r.op));
+            C& out = slots[r.out].value;
+            const C& a = valueOf(r.lhs);
+            const C& b = valueOf(r.rhs);
+            switch (r.op) {
+            case tapeOp::add:
+                assignElementwise(out, a, b, std::plus<>());
+                break;
+            case tapeOp::sub:
+                assignElementwise(out, a, b, std::minus<>());
+                break;
+            case tapeOp::mul:
+                assignElementwise(out, a, b, std::multiplies<>());
+                break;
+            case tapeOp::div:
+                assignElementwise(out, a, b, std::divides<>());
+                break;
+            case tapeOp::matmul: {
+                const size_t M = r.transA ? a.shape()[1] : a.shape()[0];
+                const size_t K = r.transA ? a.shape()[0] : a.shape()[1];
+                const size_t N = r.transB ? b.shape()[0] : b.shape()[1];
+                gemm(r.transA, r.transB, M, N, K, T(1), a.data(), a.shape()[1],
+                     b.data(), b.shape()[1], T(0), out.data(), N);
+                break;
+            }
+            case tapeOp::relu:
+                activationForward<reluAct>(out, a);
+                break;
+            case tapeOp::tanh:
+                activationForward<tanhAct>(out, a);
+                break;
+            case tapeOp::sigmoid:
+                activationForward<sigmoidAct>(out, a);
+                break;
+            case tapeOp::exp:
+                activationForward<expAct>(out, a);
+                break;
+            case tapeOp::log:
+                activationForward<logAct>(out, a);
+                break;
+            case tapeOp::linear:
+                linearForward(a.shape()[0], a.shape()[1], b.shape()[1], a.data(), b.data(),
+                              valueOf(r.aux).data(), out.data());
+                break;
+            case tapeOp::softmaxCrossEntropy:
+                out.data()[0] = softmaxCrossEntropyForward(a.shape()[0], a.shape()[1],
+                                                           a.data(), b.data());
+                break;
+            }
+        }
+        forwarded = true;
+    }
+
+    // Backward from the finalized output, seeded with ones.
+    void backward() {
+        requireForwarded();
+        beginPass(root);
+        for (uint32_t k : backwardOrder) {
+            backprop(records[k]);
+        }
+        finishPass();
+    }
+
+    void replay() {
+        forward();
+        backward();
+    }
+
+    // Drops every record and slot.
+    void clear() {
+        for (auto& s : slots) {
+            bufferPool<C>::release(std::move(s.value));
+            bufferPool<C>::release(std::move(s.grad));
+        }
+        slots.clear();
+        records.clear();
+        index.clear();
+        backwardOrder.clear();
+        finalized = false;
+        forwarded = false;
+    }
+
+    const C& output() const {
+        requireForwarded();
+        return slots[root].value;
+    }
+    const std::vector<tapeRecord>& getRecords() const { return records; }
+
+private:
+    struct slot {
+        // The tensor behind the slot. Op results let go of theirs at
+        // finalize() and are replayed into value instead; inputs read the
+        // tensor's current data unless setInput() overrode it.
+        std::shared_ptr<gradTensor<T, C>> tensor;
+        bool input = false;
+        bool overridden = false;
+        C value;
+        C grad;
+        bool hasBuffer = false;
+        bool needsGrad = false;
+        // Whether grad holds a contribution from the current pass.
+        bool hasGrad = false;
+    };
+
+    std::vector<tapeRecord> records;
+    std::vector<slot> slots;
+    std::unordered_map<const gradTensor<T, C>*, uint32_t> index;
+    std::vector<uint32_t> backwardOrder;
+    uint32_t root = 0;
+    bool finalized = false;
+    // Whether the op result values are valid: captured at finalize() or
+    // computed by forward(), but not yet for a freshly loaded tape.
+    bool forwarded = false;
+
+    // Fixes the backward order from root and preallocates the buffers a
+    // replay writes.
+    void plan() {
+        slots[root].needsGrad = true;
+        for (size_t k = records.size(); k-- > 0;) {
+            const tapeRecord& r = records[k];
+            if (r.requiresGrad && slots[r.out].needsGrad) {
+                slots[r.lhs].needsGrad = true;
+                slots[r.rhs].needsGrad = true;
+                slots[r.aux].needsGrad = true;
+                backwardOrder.push_back(static_cast<uint32_t>(k));
+            }
+        }
+        for (uint32_t i = 0; i < slots.size(); ++i) {
+            slot& s = slots[i];
+            if (s.needsGrad && !s.hasBuffer) {
+                s.grad = bufferPool<C>::acquire(valueOf(i).shape());
+                s.hasBuffer = true;
+            }
+            // Op results are recomputed into their own buffers on replay,
+            // which start out holding the captured values so backward()
+            // can run before the first forward(). A loaded tape has
+            // allocated those already.
+            if (!s.input && s.tensor) {
+                s.value = bufferPool<C>::acquire(s.tensor->getData().shape());
+                xt::noalias(s.value) = s.tensor->getData();
+                s.tensor.reset();
+            }
+        }
+        finalized = true;
+    }
+
+    // Rejects loaded records that a replay could not run safely. Every op
+    // result slot must be written by exactly one record, records may only
+    // read inputs and the results of earlier records, and each record's
+    // operand shapes must fit its op and give the shape stored for its
+    // result.
+    static void checkRecords(const std::vector<tapeRecord>& list, const std::vector<slot>& table,
+                             const std::vector<std::vector<size_t>>& shapes) {
+        std::vector<bool> written(table.size(), false);
+        auto readable = [&](uint32_t i) { return table[i].input || written[i]; };
+        for (const tapeRecord& r : list) {
+            if (table[r.out].input || written[r.out]) {
+                throw std::runtime_error("gradTape file writes an input or a slot twice");
+            }
+            if (!readable(r.lhs) || !readable(r.rhs) || !readable(r.aux)) {
+                throw std::runtime_error("gradTape file reads a slot before it is written");
+            }
+            if (inferShape(r, shapes) != shapes[r.out]) {
+                throw std::runtime_error(
+                    std::string("gradTape file has a wrong result shape for ") + tapeOpName(r.op));
+            }
+            written[r.out] = true;
+        }
+        for (size_t i = 0; i < table.size(); ++i) {
+            if (!table[i].input && !written[i]) {
+                throw std::runtime_error("gradTape file has a slot that no record writes");
+            }
+        }
+    }
+
+    // The shape of a record's result, inferred from its operands as the
+    // eager op would.
+    static std::vector<size_t> inferShape(const tapeRecord& r,
+                                          const std::vector<std::vector<size_t>>& shapes) {
+        const std::vector<size_t>& a = shapes[r.lhs];
+        const std::vector<size_t>& b = shapes[r.rhs];
+        const std::runtime_error mismatch(
+            std::string("gradTape file has mismatched operands for ") + tapeOpName(r.op));
+        std::vector<size_t> out;
+        switch (r.op) {
+        case tapeOp::add:
+        case tapeOp::sub:
+        case tapeOp::mul:
+        case tapeOp::div:
+            if (!broadcastShape(a, b, out)) {
+                throw mismatch;
+            }
+            return out;
+        case tapeOp::matmul: {
+            if (a.size() != 2 || b.size() != 2 ||
+                (r.transA ? a[0] : a[1]) != (r.transB ? b[1] : b[0])) {
+                throw mismatch;
+            }
+            return {r.transA ? a[1] : a[0], r.transB ? b[0] : b[1]};
+        }
+        case tapeOp::relu:
+        case tapeOp::tanh:
+        case tapeOp::sigmoid:
+        case tapeOp::exp:
+        case tapeOp::log:
+            return a;
+        case tapeOp::linear: {
+            const std::vector<size_t>& bias = shapes[r.aux];
+            if (a.size() != 2 || b.size() != 2 || bias.size() != 1 || a[1] != b[0] ||
+                bias[0] != b[1]) {
+                throw mismatch;
+            }
+            return {a[0], b[1]};
+        }
+        case tapeOp::softmaxCrossEntropy:
+            if (a.size() != 2 || a != b || a[1] == 0 || r.lhs == r.rhs) {
+                throw mismatch;
+            }
+            return {};
+        }
+        throw mismatch;
+    }
+
+    uint32_t slotOf(const std::shared_ptr<gradTensor<T, C>>& tensor) {
+        auto it = index.find(tensor.get());
+        if (it != index.end()) {
+            return it->second;
+        }
+        const uint32_t i = static_cast<uint32_t>(slots.size());
+        slots.emplace_back();
+        slots.back().tensor = tensor;
+        slots.back().input = true;
+        index.emplace(tensor.get(), i);
+        return i;
+    }
+
+    uint32_t outputSlot(const std::shared_ptr<gradTensor<T, C>>& output) const {
+        auto it = index.find(output.get());
+        if (it == index.end() || slots[it->second].input) {
+            throw std::invalid_argument("gradTape output must be the result of a recorded op");
+        }
+        return it->second;
+    }
+
+    const C& valueOf(uint32_t i) const {
+        const slot& s = slots[i];
+        return s.tensor && !s.overridden ? s.tensor->getData() : s.value;
+    }
+
+    void requireFinalized() const {
+        if (!finalized) {
+            throw std::logic_error("gradTape must be finalized before it is replayed");
+        }
+    }
+
+    void requireForwarded() const {
+        requireFinalized();
+        if (!forwarded) {
+            throw std::logic_error(
+                "A loaded gradTape needs forward() before backward() or output()");
+        }
+    }
+
+    void beginPass(uint32_t out) {
+        for (auto& s : slots) {
+            s.hasGrad = false;
+        }
+        slot& s = gradientOf(out);
+        s.grad.fill(T(1));
+        s.hasGrad = true;
+    }
+
+    // Inputs hand their gradient on to their tensor.
+    void finishPass() {
+        for (auto& s : slots) {
+            if (s.input && s.hasGrad) {
+                s.tensor->gradEdge()->accumulateGrad(s.grad);
+            }
+        }
+    }
+
+    // The slot with its gradient buffer allocated.
+    slot& gradientOf(uint32_t i) {
+        slot& s = slots[i];
+        if (!s.hasBuffer) {
+            s.grad = bufferPool<C>::acquire(valueOf(i).shape());
+            s.hasBuffer = true;
+        }
+        return s;
+    }
+
+    void backprop(const tapeRecord& r) {
+        if (!r.requiresGrad || !slots[r.out].hasGrad) {
+            return;
+        }
+        GRADTENSOR_PROFILE_BACKWARD(tapeOpName(r.op), &slots[r.out]);
+        const C& g = slots[r.out].grad;
+        const C& a = valueOf(r.lhs);
+        const C& b = valueOf(r.rhs);
+        switch (r.op) {
+        case tapeOp::add:
+            accumulateSlot(r.lhs, g);
+            accumulateSlot(r.rhs, g);
+            break;
+        case tapeOp::sub:
+            accumulateSlot(r.lhs, g);
+            accumulateSlot(r.rhs, -g);
+            break;
+        case tapeOp::mul:
+            accumulateSlot(r.lhs, g * b);
+            accumulateSlot(r.rhs, g * a);
+            break;
+        case tapeOp::div:
+            accumulateSlot(r.lhs, g / b);
+            accumulateSlot(r.rhs, -(g * a) / (b * b));
+            break;
+        case tapeOp::matmul: {
+            bool fresh;
+            T* ga = sinkOf(r.lhs, fresh);
+            matmulGradLhs(g, a, b, r.transA, r.transB, ga, fresh);
+            T* gb = sinkOf(r.rhs, fresh);
+            matmulGradRhs(g, a, r.transA, r.transB, gb, fresh);
+            break;
+        }
+        case tapeOp::relu:
+            activationBackprop<reluAct>(r, g, a);
+            break;
+        case tapeOp::tanh:
+            activationBackprop<tanhAct>(r, g, a);
+            break;
+        case tapeOp::sigmoid:
+            activationBackprop<sigmoidAct>(r, g, a);
+            break;
+        case tapeOp::exp:
+            activationBackprop<expAct>(r, g, a);
+            break;
+        case tapeOp::log:
+            activationBackprop<logAct>(r, g, a);
+            break;
+        case tapeOp::linear: {
+            bool fresh;
+            T* gx = sinkOf(r.lhs, fresh);
+            matmulGradLhs(g, a, b, false, false, gx, fresh);
+            T* gw = sinkOf(r.rhs, fresh);
+            matmulGradRhs(g, a, false, false, gw, fresh);
+            T* gbias = sinkOf(r.aux, fresh);
+            biasGrad(g.shape()[0], g.shape()[1], g.data(), gbias, fresh);
+            break;
+        }
+        case tapeOp::softmaxCrossEntropy: {
+            bool freshZ, freshT;
+            T* gz = sinkOf(r.lhs, freshZ);
+            T* gt = sinkOf(r.rhs, freshT);
+            softmaxCrossEntropyGrad(a.shape()[0], a.shape()[1], a.data(), b.data(),
+                                    g.data()[0], gz, freshZ, gt, freshT);
+            break;
+        }
+        }
+    }
+
+    // Raw gradient buffer of a slot for kernels that write in place;
+    // fresh tells them to assign rather than add.
+    T* sinkOf(uint32_t i, bool& fresh) {
+        slot& s = gradientOf(i);
+        fresh = !s.hasGrad;
+        s.hasGrad = true;
+        return s.grad.data();
+    }
+
+    template <class Act>
+    void activationBackprop(const tapeRecord& r, const C& g, const C& x) {
+        bool fresh;
+        T* out = sinkOf(r.lhs, fresh);
+        activationGrad<Act>(g.size(), g.data(), x.data(), out, fresh);
+    }
+
+    template <class E>
+    void accumulateSlot(uint32_t i, const E& g) {
+        slot& s = gradientOf(i);
+        const auto& target = s.grad.shape();
+        const auto& full = g.shape();
+        const bool broadcast = full.size() != target.size() ||
+                               !std::equal(full.begin(), full.end(), target.begin());
+        if (broadcast && s.hasGrad) {
+            xt::noalias(s.grad) += reduceToShape<T>(g, target);
+        } else if (broadcast) {
+            xt::noalias(s.grad) = reduceToShape<T>(g, target);
+        } else if (s.hasGrad) {
+            xt::noalias(s.grad) += g;
+        } else {
+            xt::noalias(s.grad) = g;
+        }
+        s.hasGrad = true;
+    }
+};
+
+// Records every op on the current thread into a tape for its lifetime.
+// With graph = false the ops build no backops or gradNodes of their own.
+template <typename T, class C = xt::xarray<T>>
+class tapeCapture {
+    gradTape<T, C>* previous;
+    bool previousGraph;
+public:
+    explicit tapeCapture(gradTape<T, C>& tape, bool graph = true)
+        : previous(gradTape<T, C>::active()), previousGraph(gradTape<T, C>::buildsGraph()) {
+        gradTape<T, C>::active() = &tape;
+        gradTape<T, C>::buildsGraph() = graph;
+    }
+    ~tapeCapture() {
+        gradTape<T, C>::active() = previous;
+        gradTape<T, C>::buildsGraph() = previousGraph;
+    }
+
+    tapeCapture(const tapeCapture&) = delete;
+    tapeCapture& operator=(const tapeCapture&) = delete;
+};
+
+// ===================== Fused Expressions =====================
+// Opt-in lazy layer over elementwise chains. lazy(a) * b + c builds a tree
+// of xtensor expressions instead of one gradTensor per operator; eval() or
+// conversion to shared_ptr<gradTensor<T>> materializes the whole chain in a
+// single loop and records one fusedBackward node for it. The backward pass
+// recomputes the interior values inside each leaf's gradient expression, so
+// no intermediate is ever stored.
+template <typename T, class D>
+class gradExpr {
+public:
+    const D& self() const { return static_cast<const D&>(*this); }
+
+    std::shared_ptr<gradTensor<T>> eval() const;
+    operator std::shared_ptr<gradTensor<T>>() const { return eval(); }
+};
+
+// A leaf saves its tensor's values as a backop does, and takes the
+// tensor's node when it is made. Modifying the tensor in place afterwards
+// makes the chain throw instead of reading the new values, and gradients
+// still reach the node the saved values belong to.
+template <typename T>
+class leafExpr : public gradExpr<T, leafExpr<T>> {
+    savedTensor<T, xt::xarray<T>> saved;
+    std::shared_ptr<gradNode<T>> node;
+public:
+    explicit leafExpr(const std::shared_ptr<gradTensor<T>>& t)
+        : saved(savedData(t)), node(t->gradEdge()) {}
+
+    decltype(auto) shape() const { return saved->shape(); }
+    const xt::xarray<T>& value() const { return *saved; }
+
+    template <class G, class Sink>
+    void backprop(const G& g, const Sink& sink) const {
+        sink(*node, g);
+    }
+
+    void collect(typename backop<T>::edgeList& leaves) const {
+        leaves.push_back(node);
+    }
+};
+
+// Each op forwards its operands into the xtensor operator so that lazy
+// temporaries are held by value inside the resulting expression.
+struct fusedAdd {
+    static constexpr const char* symbol = "+";
+    template <class A, class B>
+    static auto apply(A&& a, B&& b) { return std::forward<A>(a) + std::forward<B>(b); }
+    template <class L, class R, class G, class Sink>
+    static void backprop(const L& lhs, const R& rhs, const G& g, const Sink& sink) {
+        lhs.backprop(g, sink);
+        rhs.backprop(g, sink);
+    }
+};
+
+struct fusedSub {
+    static constexpr const char* symbol = "-";
+    template <class A, class B>
+    static auto apply(A&& a, B&& b) { return std::forward<A>(a) - std::forward<B>(b); }
+    template <class L, class R, class G, class Sink>
+    static void backprop(const L& lhs, const R& rhs, const G& g, const Sink& sink) {
+        lhs.backprop(g, sink);
+        rhs.backprop(-g, sink);
+    }
+};
+
+struct fusedMul {
+    static constexpr const char* symbol = "*";
+    template <class A, class B>
+    static auto apply(A&& a, B&& b) { return std::forward<A>(a) * std::forward<B>(b); }
+    template <class L, class R, class G, class Sink>
+    static void backprop(const L& lhs, const R& rhs, const G& g, const Sink& sink) {
+        lhs.backprop(g * rhs.value(), sink);
+        rhs.backprop(g * lhs.value(), sink);
+    }
+};
+
+struct fusedDiv {
+    static constexpr const char* symbol = "/";
+    template <class A, class B>
+    static auto apply(A&& a, B&& b) { return std::forward<A>(a) / std::forward<B>(b); }
+    template <class L, class R, class G, class Sink>
+    static void backprop(const L& lhs, const R& rhs, const G& g, const Sink& sink) {
+        lhs.backprop(g / rhs.value(), sink);
+        rhs.backprop(-(g * lhs.value()) / (rhs.value() * rhs.value()), sink);
+    }
+};
+
+template <typename T, class Op, class L, class R>
+class binaryExpr : public gradExpr<T, binaryExpr<T, Op, L, R>> {
+    L lhs;
+    R rhs;
+    typename xt::xarray<T>::shape_type outShape;
+public:
+    binaryExpr(L l, R r) : lhs(std::move(l)), rhs(std::move(r)) {
+        if (!broadcastShape(lhs.shape(), rhs.shape(), outShape)) {
+            throw std::invalid_argument(std::string("Shape mismatch for ") + Op::symbol);
+        }
+    }
+
+    const typename xt::xarray<T>::shape_type& shape() const { return outShape; }
+    auto value() const { return Op::apply(lhs.value(), rhs.value()); }
+
+    template <class G, class Sink>
+    void backprop(const G& g, const Sink& sink) const {
+        Op::backprop(lhs, rhs, g, sink);
+    }
+
+    void collect(typename backop<T>::edgeList& leaves) const {
+        lhs.collect(leaves);
+        rhs.collect(leaves);
+    }
+};
+
+template <typename T, class E>
+class fusedBackward : public backop<T> {
+    // The leaves hold their tensors and nodes, so the expression is dropped
+    // with the rest of the saved data.
+    std::optional<E> expr;
+
+public:
+    explicit fusedBackward(const E& e) : backop<T>({}), expr(e) {
+        expr->collect(this->inputs);
+    }
+
+    void releaseSaved() override { expr.reset(); }
+
+    void backward(const xt::xarray<T>& accum_grad) override {
+        expr->backprop(accum_grad, [](gradNode<T>& leaf, const auto& g) {
+            accumulateToShape(leaf, g);
+        });
+    }
+
+    // The leaves' values broadcast against the stack along its trailing
+    // axes, as mulBackward's saved operands do.
+    void backwardBatch(const xt::xarray<T>& grads, batchPass<T>& pass) override {
+        expr->backprop(grads, [&pass](gradNode<T>& leaf, const auto& g) {
+            pass.accumulate(leaf, g);
+        });
+    }
+};
+
+template <typename T, class D>
+std::shared_ptr<gradTensor<T>> gradExpr<T, D>::eval() const {
+    GRADTENSOR_PROFILE_FORWARD("fused");
+    if (gradTape<T>::active()) {
+        throw std::logic_error("Lazy expressions cannot be recorded on a gradTape");
+    }
+    xt::xarray<T> newData = bufferPool<xt::xarray<T>>::acquire(self().shape());
+    xt::noalias(newData) = self().value();
+    auto ret = makeGraphObject<gradTensor<T>>(std::move(newData));
+    if (gradMode::isEnabled()) {
+        ret->setSource(makeGraphObject<fusedBackward<T, D>>(self()));
+    }
+    GRADTENSOR_PROFILE_RESULT(ret);
+    return ret;
+}
+
+template <typename T>
+leafExpr<T> lazy(const std::shared_ptr<gradTensor<T>>& tensor) {
+    return leafExpr<T>(tensor);
+}
+
+template <typename T, class Op, class L, class R>
+binaryExpr<T, Op, L, R> makeBinaryExpr(const gradExpr<T, L>& lhs,
+                                       const gradExpr<T, R>& rhs) {
+    return binaryExpr<T, Op, L, R>(lhs.self(), rhs.self());
+}
+
+template <typename T, class L, class R>
+auto operator+(const gradExpr<T, L>& lhs, const gradExpr<T, R>& rhs) {
+    return makeBinaryExpr<T, fusedAdd>(lhs, rhs);
+}
+
+template <typename T, class L, class R>
+auto operator-(const gradExpr<T, L>& lhs, const gradExpr<T, R>& rhs) {
+    return makeBinaryExpr<T, fusedSub>(lhs, rhs);
+}
+
+template <typename T, class L, class R>
+auto operator*(const gradExpr<T, L>& lhs, const gradExpr<T, R>& rhs) {
+    return makeBinaryExpr<T, fusedMul>(lhs, rhs);
+}
+
+template <typename T, class L, class R>
+auto operator/(const gradExpr<T, L>& lhs, const gradExpr<T, R>& rhs) {
+    return makeBinaryExpr<T, fusedDiv>(lhs, rhs);
+}
+
+// Mixing a lazy chain with a plain tensor keeps the chain lazy.
+template <typename T, class L>
+auto operator+(const gradExpr<T, L>& lhs, const std::shared_ptr<gradTensor<T>>& rhs) {
+    return lhs + lazy(rhs);
+}
+
+template <typename T, class R>
+auto operator+(const std::shared_ptr<gradTensor<T>>& lhs, const gradExpr<T, R>& rhs) {
+    return lazy(lhs) + rhs;
+}
+
+template <typename T, class L>
+auto operator-(const gradExpr<T, L>& lhs, const std::shared_ptr<gradTensor<T>>& rhs) {
+    return lhs - lazy(rhs);
+}
+
+template <typename T, class R>
+auto operator-(const std::shared_ptr<gradTensor<T>>& lhs, const gradExpr<T, R>& rhs) {
+    return lazy(lhs) - rhs;
+}
+
+template <typename T, class L>
+auto operator*(const gradExpr<T, L>& lhs, const std::shared_ptr<gradTensor<T>>& rhs) {
+    return lhs * lazy(rhs);
+}
+
+template <typename T, class R>
+auto operator*(const std::shared_ptr<gradTensor<T>>& lhs, const gradExpr<T, R>& rhs) {
+    return lazy(lhs) * rhs;
+}
+
+template <typename T, class L>
+auto operator/(const gradExpr<T, L>& lhs, const std::shared_ptr<gradTensor<T>>& rhs) {
+    return lhs / lazy(rhs);
+}
+
+template <typename T, class R>
+auto operator/(const std::shared_ptr<gradTensor<T>>& lhs, const gradExpr<T, R>& rhs) {
+    return lazy(lhs) / rhs;
+}
+
+// ===================== Scalars =====================
+// A scalar graph node with its value, gradient and local partials stored
+// inline, for scalar work such as loss bookkeeping and hyperparameter
+// gradients. An op allocates exactly one object: there is no container,
+// shape or backop to build. Each op records the derivative of its value
+// with respect to each operand at forward time, so backward does one
+// multiply-add per edge. Unlike gradNode, a gradScalar keeps no lock:
+// passes over scalar graphs that share nodes must not run concurrently.
+template <typename T>
+class gradScalar {
+private:
+    T value;
+    T grad = T(0);
+    // Sum of the contributions received during the current backward pass.
+    T pending = T(0);
+    bool hasGrad = false;
+    bool visited = false;
+    // Set once a backward pass has released this node's operands.
+    bool graphReleased = false;
+    // Operands and d(value)/d(operand); unused slots are null.
+    std::shared_ptr<gradScalar> parents[2];
+    T partials[2] = {T(0), T(0)};
+
+    // Scratch for the traversal, reused across passes on a thread.
+    struct scratch {
+        std::vector<gradScalar*> order;
+        std::vector<std::pair<gradScalar*, int>> stack;
+    };
+
+    static scratch& local() {
+        static thread_local scratch s;
+        return s;
+    }
+
+    // Same iterative post-order walk as backwardEngine::topoSort, with the
+    // visited set kept as a flag on each node.
+    void topoSort(std::vector<gradScalar*>& order) {
+        auto& stack = local().stack;
+        stack.clear();
+        visited = true;
+        stack.emplace_back(this, 0);
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            gradScalar* node = frame.first;
+            if (node->graphReleased) {
+                for (gradScalar* n : order) {
+                    n->visited = false;
+                }
+                for (auto& f : stack) {
+                    f.first->visited = false;
+                }
+                throw std::logic_error("Trying to backward through a graph that has already been "
+                                       "released; pass retainGraph = true to the first backward");
+            }
+            if (frame.second < 2) {
+                gradScalar* input = node->parents[frame.second++].get();
+                if (input && !input->visited) {
+                    input->visited = true;
+                    stack.emplace_back(input, 0);
+                }
+            } else {
+                order.push_back(node);
+                stack.pop_back();
+            }
+        }
+    }
+
+public:
+    gradScalar(T v = T(0)) : value(v) {}
+
+    // Tears the graph down with a worklist, as ~gradNode does.
+    ~gradScalar() {
+        std::vector<std::shared_ptr<gradScalar>> nodes;
+        for (auto& p : parents) {
+            if (p && p.use_count() == 1) {
+                nodes.push_back(std::move(p));
+            }
+        }
+        while (!nodes.empty()) {
+            std::shared_ptr<gradScalar> node = std::move(nodes.back());
+            nodes.pop_back();
+            for (auto& p : node->parents) {
+                if (p && p.use_count() == 1) {
+                    nodes.push_back(std::move(p));
+                }
+            }
+        }
+    }
+
+    // Builds an op result; the operands are only recorded in grad mode.
+    static std::shared_ptr<gradScalar> record(T v, const std::shared_ptr<gradScalar>& a, T da,
+                                              const std::shared_ptr<gradScalar>& b, T db) {
+        auto ret = makeGraphObject<gradScalar>(v);
+        if (gradMode::isEnabled()) {
+            ret->parents[0] = a;
+            ret->parents[1] = b;
+            ret->partials[0] = da;
+            ret->partials[1] = db;
+        }
+        return ret;
+    }
+
+    T getData() const { return value; }
+    T getGrad() const { return grad; }
+    bool hasGradient() const { return hasGrad; }
+
+    void backward(bool retainGraph = false) { backward(T(1), retainGraph); }
+
+    void backward(T seed, bool retainGraph = false) {
+        auto& order = local().order;
+        order.clear();
+        topoSort(order);
+        pending += seed;
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            gradScalar* node = *it;
+            const T g = node->pending;
+            for (int i = 0; i < 2; ++i) {
+                if (node->parents[i]) {
+                    node->parents[i]->pending += node->partials[i] * g;
+                }
+            }
+            node->grad += g;
+            node->hasGrad = true;
+            node->pending = T(0);
+            node->visited = false;
+        }
+        // Leaves come first in the order, so a node is only ever freed
+        // after its last consumer and is never touched again.
+        if (!retainGraph) {
+            for (gradScalar* node : order) {
+                if (node->parents[0] || node->parents[1]) {
+                    node->graphReleased = true;
+                    node->parents[0].reset();
+                    node->parents[1].reset();
+                }
+            }
+        }
+        order.clear();
+    }
+};
+
+template <typename T>
+std::shared_ptr<gradScalar<T>> operator+(const std::shared_ptr<gradScalar<T>>& first,
+                                         const std::shared_ptr<gradScalar<T>>& second) {
+    return gradScalar<T>::record(first->getData() + second->getData(),
+                                 first, T(1), second, T(1));
+}
+
+template <typename T>
+std::shared_ptr<gradScalar<T>> operator-(const std::shared_ptr<gradScalar<T>>& first,
+                                         const std::shared_ptr<gradScalar<T>>& second) {
+    return gradScalar<T>::record(first->getData() - second->getData(),
+                                 first, T(1), second, T(-1));
+}
+
+template <typename T>
+std::shared_ptr<gradScalar<T>> operator*(const std::shared_ptr<gradScalar<T>>& first,
+                                         const std::shared_ptr<gradScalar<T>>& second) {
+    const T a = first->getData();
+    const T b = second->getData();
+    return gradScalar<T>::record(a * b, first, b, second, a);
+}
+
+template <typename T>
+std::shared_ptr<gradScalar<T>> operator/(const std::shared_ptr<gradScalar<T>>& first,
+                                         const std::shared_ptr<gradScalar<T>>& second) {
+    const T a = first->getData();
+    const T inv = T(1) / second->getData();
+    return gradScalar<T>::record(a * inv, first, inv, second, -a * inv * inv);
+}
+
+// ===================== Forward Mode =====================
+// Dual tensors for forward-mode differentiation: each carries its values
+// and a tangent, the derivative along one input direction, and every op
+// produces both in a single pass over its operands. There is no graph, so
+// nothing is saved or freed afterwards. One pass yields a Jacobian-vector
+// product, which makes forward mode the cheaper choice when there are few
+// inputs and many outputs.
+template <typename T, class C = xt::xarray<T>>
+class dualTensor {
+private:
+    C primal;
+    C tangent;
+
+public:
+    // A constant: its tangent is zero.
+    dualTensor(C p) : primal(std::move(p)), tangent(xt::zeros<T>(primal.shape())) {}
+    dualTensor(C p, C t) : primal(std::move(p)), tangent(std::move(t)) {
+        if (primal.shape() != tangent.shape()) {
+            throw std::invalid_argument("Tangent shape mismatch");
+        }
+    }
+
+    const C& getPrimal() const { return primal; }
+    const C& getTangent() const { return tangent; }
+};
+
+// Elementwise rules, written once for both scalars and xtensor
+// expressions: the scalars drive the fused loop, the expressions the
+// broadcasting fallback.
+struct dualAdd {
+    template <class A, class B>
+    static auto value(const A& a, const B& b) { return a + b; }
+    template <class A, class B, class DA, class DB>
+    static auto tangent(const A&, const B&, const DA& da, const DB& db) { return da + db; }
+};
+
+struct dualSub {
+    template <class A, class B>
+    static auto value(const A& a, const B& b) { return a - b; }
+    template <class A, class B, class DA, class DB>
+    static auto tangent(const A&, const B&, const DA& da, const DB& db) { return da - db; }
+};
+
+struct dualMul {
+    template <class A, class B>
+    static auto value(const A& a, const B& b) { return a * b; }
+    template <class A, class B, class DA, class DB>
+    static auto tangent(const A& a, const B& b, const DA& da, const DB& db) {
+        return da * b + a * db;
+    }
+};
+
+struct dualDiv {
+    template <class A, class B>
+    static auto value(const A& a, const B& b) { return a / b; }
+    template <class A, class B, class DA, class DB>
+    static auto tangent(const A& a, const B& b, const DA& da, const DB& db) {
+        return (da * b - a * db) / (b * b);
+    }
+};
+
+template <class Rule, typename T, class C>
+dualTensor<T, C> dualElementwise(const dualTensor<T, C>& first, const dualTensor<T, C>& second,
+                                 const char* symbol) {
+    const C& a = first.getPrimal();
+    const C& b = second.getPrimal();
+    const C& da = first.getTangent();
+    const C& db = second.getTangent();
+    if constexpr (!isFixedContainer<C>::value) {
+        typename C::shape_type shape{};
+        if (!broadcastShape(a.shape(), b.shape(), shape)) {
+            throw std::invalid_argument(std::string("Shape mismatch for ") + symbol);
+        }
+        if (a.size() != b.size() || a.shape() != shape) {
+            return dualTensor<T, C>(C(Rule::value(a, b)), C(Rule::tangent(a, b, da, db)));
+        }
+    }
+    C y = bufferPool<C>::acquire(a.shape());
+    C dy = bufferPool<C>::acquire(a.shape());
+    T* __restrict py = y.data();
+    T* __restrict pdy = dy.data();
+    const T* pa = a.data();
+    const T* pb = b.data();
+    const T* pda = da.data();
+    const T* pdb = db.data();
+    parallelFor(y.size(), [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            py[i] = Rule::value(pa[i], pb[i]);
+            pdy[i] = Rule::tangent(pa[i], pb[i], pda[i], pdb[i]);
+        }
+    });
+    return dualTensor<T, C>(std::move(y), std::move(dy));
+}
+
+template <typename T, class C>
+dualTensor<T, C> operator+(const dualTensor<T, C>& first, const dualTensor<T, C>& second) {
+    return dualElementwise<dualAdd>(first, second, "+");
+}
+
+template <typename T, class C>
+dualTensor<T, C> operator-(const dualTensor<T, C>& first, const dualTensor<T, C>& second) {
+    return dualElementwise<dualSub>(first, second, "-");
+}
+
+template <typename T, class C>
+dualTensor<T, C> operator*(const dualTensor<T, C>& first, const dualTensor<T, C>& second) {
+    return dualElementwise<dualMul>(first, second, "*");
+}
+
+template <typename T, class C>
+dualTensor<T, C> operator/(const dualTensor<T, C>& first, const dualTensor<T, C>& second) {
+    return dualElementwise<dualDiv>(first, second, "/");
+}
+
+template <class Act, typename T, class C>
+dualTensor<T, C> activation(const dualTensor<T, C>& input) {
+    const C& x = input.getPrimal();
+    C y = bufferPool<C>::acquire(x.shape());
+    C dy = bufferPool<C>::acquire(x.shape());
+    T* __restrict py = y.data();
+    T* __restrict pdy = dy.data();
+    const T* px = x.data();
+    const T* pdx = input.getTangent().data();
+    parallelFor(x.size(), [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            py[i] = Act::value(px[i]);
+            pdy[i] = Act::derivative(px[i]) * pdx[i];
+        }
+    });
+    return dualTensor<T, C>(std::move(y), std::move(dy));
+}
+
+template <typename T, class C>
+dualTensor<T, C> relu(const dualTensor<T, C>& x) {
+    return activation<reluAct>(x);
+}
+
+template <typename T, class C>
+dualTensor<T, C> tanh(const dualTensor<T, C>& x) {
+    return activation<tanhAct>(x);
+}
+
+template <typename T, class C>
+dualTensor<T, C> sigmoid(const dualTensor<T, C>& x) {
+    return activation<sigmoidAct>(x);
+}
+
+template <typename T, class C>
+dualTensor<T, C> exp(const dualTensor<T, C>& x) {
+    return activation<expAct>(x);
+}
+
+template <typename T, class C>
+dualTensor<T, C> log(const dualTensor<T, C>& x) {
+    return activation<logAct>(x);
+}
+
+// d(A * B) = dA * B + A * dB, accumulated into one buffer by two gemms.
+template <typename T>
+dualTensor<T> matmul(const dualTensor<T>& first, const dualTensor<T>& second) {
+    const auto& a = first.getPrimal();
+    const auto& b = second.getPrimal();
+    if (a.dimension() != 2 || b.dimension() != 2 || a.shape()[1] != b.shape()[0]) {
+        throw std::invalid_argument("Shape mismatch for matmul");
+    }
+    const size_t M = a.shape()[0];
+    const size_t K = a.shape()[1];
+    const size_t N = b.shape()[1];
+    xt::xarray<T> y = bufferPool<xt::xarray<T>>::acquire(std::vector<size_t>{M, N});
+    xt::xarray<T> dy = bufferPool<xt::xarray<T>>::acquire(std::vector<size_t>{M, N});
+    gemm(false, false, M, N, K, T(1), a.data(), K, b.data(), N, T(0), y.data(), N);
+    gemm(false, false, M, N, K, T(1), first.getTangent().data(), K, b.data(), N, T(0),
+         dy.data(), N);
+    gemm(false, false, M, N, K, T(1), a.data(), K, second.getTangent().data(), N, T(1),
+         dy.data(), N);
+    return dualTensor<T>(std::move(y), std::move(dy));
+}
+
+template <typename T>
+dualTensor<T> linear(const dualTensor<T>& x, const dualTensor<T>& weight,
+                     const dualTensor<T>& bias) {
+    const auto& a = x.getPrimal();
+    const auto& w = weight.getPrimal();
+    const auto& b = bias.getPrimal();
+    if (a.dimension() != 2 || w.dimension() != 2 || b.dimension() != 1 ||
+        a.shape()[1] != w.shape()[0] || b.shape()[0] != w.shape()[1]) {
+        throw std::invalid_argument("Shape mismatch for linear");
+    }
+    const size_t M = a.shape()[0];
+    const size_t K = a.shape()[1];
+    const size_t N = w.shape()[1];
+    xt::xarray<T> y = bufferPool<xt::xarray<T>>::acquire(std::vector<size_t>{M, N});
+    xt::xarray<T> dy = bufferPool<xt::xarray<T>>::acquire(std::vector<size_t>{M, N});
+    linearForward(M, K, N, a.data(), w.data(), b.data(), y.data());
+    linearForward(M, K, N, x.getTangent().data(), w.data(), bias.getTangent().data(), dy.data());
+    gemm(false, false, M, N, K, T(1), a.data(), K, weight.getTangent().data(), N, T(1),
+         dy.data(), N);
+    return dualTensor<T>(std::move(y), std::move(dy));
+}
+
+// The loss tangent is the gradient of softmaxCrossEntropyGrad dotted with
+// the tangents, summed row by row without materializing the gradient.
+template <typename T>
+dualTensor<T> softmaxCrossEntropy(const dualTensor<T>& logits, const dualTensor<T>& targets) {
+    const auto& z = logits.getPrimal();
+    const auto& t = targets.getPrimal();
+    if (z.dimension() != 2 || z.shape() != t.shape()) {
+        throw std::invalid_argument("Shape mismatch for softmaxCrossEntropy");
+    }
+    using A = typename accumulatorType<T>::type;
+    const size_t M = z.shape()[0];
+    const size_t K = z.shape()[1];
+    const T* dz = logits.getTangent().data();
+    const T* dt = targets.getTangent().data();
+    A tangent = A(0);
+    for (size_t m = 0; m < M; ++m) {
+        const T* zm = z.data() + m * K;
+        const T* tm = t.data() + m * K;
+        const A lse = logSumExp(zm, K);
+        A mass = A(0);
+        for (size_t k = 0; k < K; ++k) {
+            mass += A(tm[k]);
+        }
+        for (size_t k = 0; k < K; ++k) {
+            const A logp = A(zm[k]) - lse;
+            const size_t i = m * K + k;
+            tangent += (std::exp(logp) * mass - A(tm[k])) * A(dz[i]) - logp * A(dt[i]);
+        }
+    }
+    xt::xarray<T> y = xt::xarray<T>::from_shape(std::vector<size_t>{});
+    xt::xarray<T> dy = xt::xarray<T>::from_shape(std::vector<size_t>{});
+    y.data()[0] = softmaxCrossEntropyForward(M, K, z.data(), t.data());
+    dy.data()[0] = T(tangent / A(M));
+    return dualTensor<T>(std::move(y), std::move(dy));
+}
+
+// Jacobian of f at x, one forward pass per input element, each along a
+// unit direction. Column j holds d f(x) / d x[j], flattened; the result is
+// [f(x).size(), x.size()].
+template <typename T, class F>
+xt::xarray<T> forwardJacobian(F&& f, const xt::xarray<T>& x) {
+    xt::xarray<T> jacobian;
+    xt::xarray<T> direction = xt::zeros<T>(x.shape());
+    for (size_t j = 0; j < x.size(); ++j) {
+        direction.data()[j] = T(1);
+        dualTensor<T> y = f(dualTensor<T>(x, direction));
+        direction.data()[j] = T(0);
+        const auto& dy = y.getTangent();
+        if (j == 0) {
+            jacobian = xt::xarray<T>::from_shape(std::vector<size_t>{dy.size(), x.size()});
+        }
+        for (size_t i = 0; i < dy.size(); ++i) {
+            jacobian.data()[i * x.size() + j] = dy.data()[i];
+        }
+    }
+    return jacobian;
+}
+
+#endif
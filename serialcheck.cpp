@@ -0,0 +1,172 @@
+// Round trip and corruption checks for tensor archives and saved tapes.
+// Meant to run under AddressSanitizer and UBSan:
+//
+//   g++ -std=c++17 -O1 -g -fsanitize=address,undefined -pthread serialcheck.cpp -o serialcheck
+//   ./serialcheck
+//
+// Saves an archive and a finalized tape, reads them back and compares the
+// values and the gradients a replay produces. It then loads every
+// truncation of both files, which must raise runtime_error, and every
+// single-byte corruption, which must either raise runtime_error or load
+// and replay cleanly. Exits nonzero on a mismatch.
+#include "driver.hpp"
+
+#include <cstdio>
+#include <functional>
+
+using namespace std;
+
+// ===================== Helpers =====================
+const string archivePath = "serialcheck.tensors";
+const string tapePath = "serialcheck.tape";
+const string scratchPath = "serialcheck.scratch";
+
+// Distinct values, so a slot or offset mix-up cannot go unnoticed.
+tensor ramp(vector<size_t> shape, double start, double step) {
+    tensor t = filled(move(shape), 0.0);
+    double* p = t->mutableData().data();
+    for (size_t i = 0; i < t->getData().size(); ++i) {
+        p[i] = start + step * double(i);
+    }
+    return t;
+}
+
+template <class A, class B>
+bool sameValues(const A& a, const B& b, const char* what) {
+    if (a.dimension() != b.dimension() ||
+        !equal(a.shape().begin(), a.shape().end(), b.shape().begin())) {
+        cerr << what << ": shapes differ" << endl;
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a.data()[i] != b.data()[i]) {
+            cerr << what << "[" << i << "] = " << b.data()[i] << ", expected " << a.data()[i]
+                 << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+string readFile(const string& path) {
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+void writeFile(const string& path, const string& bytes) {
+    ofstream(path, ios::binary | ios::trunc) << bytes;
+}
+
+// Opens an archive and touches every entry.
+void openArchive(const string& path) {
+    tensorArchive<double> archive(path);
+    for (size_t i = 0; i < archive.size(); ++i) {
+        archive.load(i);
+    }
+}
+
+void loadAndReplay(const string& path) {
+    gradTape<double> tape;
+    tape.load(path);
+    tape.replay();
+}
+
+// Feeds reader every strict prefix of bytes and every single-byte
+// corruption. Returns false if a prefix loads or anything throws other
+// than runtime_error.
+bool sweep(const string& bytes, const char* what, const function<void(const string&)>& reader) {
+    bool ok = true;
+    for (size_t n = 0; n < bytes.size(); ++n) {
+        writeFile(scratchPath, bytes.substr(0, n));
+        try {
+            reader(scratchPath);
+            cerr << what << " truncated to " << n << " bytes loaded" << endl;
+            ok = false;
+        } catch (const runtime_error&) {
+        }
+    }
+    size_t rejected = 0;
+    size_t loaded = 0;
+    for (size_t pos = 0; pos < bytes.size(); ++pos) {
+        for (unsigned char v : {0x00, 0x01, 0x7f, 0xff}) {
+            if (static_cast<unsigned char>(bytes[pos]) == v) {
+                continue;
+            }
+            string corrupt = bytes;
+            corrupt[pos] = static_cast<char>(v);
+            writeFile(scratchPath, corrupt);
+            try {
+                reader(scratchPath);
+                ++loaded;
+            } catch (const runtime_error&) {
+                ++rejected;
+            } catch (const exception& e) {
+                cerr << what << " byte " << pos << " = " << unsigned(v) << " threw " << e.what()
+                     << endl;
+                ok = false;
+            }
+        }
+    }
+    cout << what << ": " << rejected << " corruptions rejected, " << loaded << " loaded" << endl;
+    return ok;
+}
+
+// ===================== Driver =====================
+int main() {
+    bool ok = true;
+
+    // Tensor archive: one entry with a gradient, one without, one 0-d.
+    auto a = ramp({2, 3}, 0.5, 0.25);
+    auto b = ramp({4}, -1.0, 0.5);
+    auto s = ramp({}, 3.0, 0.0);
+    (a * a)->backward();
+    saveTensors(archivePath, vector<tensor>{a, b, s});
+    {
+        tensorArchive<double> archive(archivePath);
+        ok &= archive.size() == 3 && archive.hasGrad(0) && !archive.hasGrad(1);
+        ok &= sameValues(a->getData(), archive.values(0), "archive values 0");
+        ok &= sameValues(a->getGrad(), archive.grad(0), "archive grad 0");
+        ok &= sameValues(b->getData(), archive.load(1)->getData(), "archive values 1");
+        ok &= sameValues(s->getData(), archive.values(2), "archive values 2");
+    }
+
+    // Tape over every kind of record: broadcast, matmul, activations,
+    // linear and softmax cross-entropy.
+    auto x = ramp({2, 3}, 0.1, 0.1);
+    auto w = ramp({3, 4}, -0.3, 0.05);
+    auto bias = ramp({4}, 0.2, -0.15);
+    auto v = ramp({4, 4}, 0.05, 0.02);
+    auto targets = filled({2, 4}, 0.25);
+    gradTape<double> tape;
+    tensor loss;
+    {
+        tapeCapture<double> capture(tape, false);
+        auto h = tanh(linear(x, w, bias));
+        auto z = sigmoid(matmul(h, v)) * exp(h) - relu(h) / (exp(h) + bias * bias);
+        loss = softmaxCrossEntropy(log(z * z + bias * bias), targets);
+    }
+    tape.finalize(loss);
+    tape.replay();
+    tape.save(tapePath);
+
+    gradTape<double> loaded;
+    loaded.load(tapePath);
+    loaded.replay();
+    ok &= sameValues(tape.output(), loaded.output(), "tape output");
+    const auto before = tape.inputs();
+    const auto after = loaded.inputs();
+    ok &= before.size() == after.size();
+    for (size_t i = 0; ok && i < before.size(); ++i) {
+        ok &= sameValues(before[i]->getData(), after[i]->getData(), "tape input");
+        ok &= sameValues(before[i]->getGrad(), after[i]->getGrad(), "tape input grad");
+    }
+
+    ok &= sweep(readFile(archivePath), "archive", openArchive);
+    ok &= sweep(readFile(tapePath), "tape", loadAndReplay);
+
+    remove(archivePath.c_str());
+    remove(tapePath.c_str());
+    remove(scratchPath.c_str());
+    cout << (ok ? "ok" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+// Stress driver for concurrent backward passes over shared leaves. Meant to
+// run under ThreadSanitizer:
+//
+//   g++ -std=c++17 -O1 -g -fsanitize=thread -pthread stress.cpp -o stress
+//   ./stress [threads] [iterations] [rounds] [poolThreads]
+//
+// Every round several threads start at once, each building and
+// backpropagating its own graphs over two long-lived weights and one leaf
+// created for that round, so first use of a leaf races too. All values are
+// small dyadic fractions, which keeps the summed gradients exact whatever
+// order the contributions land in. Exits nonzero on a mismatch.
+#include "driver.hpp"
+
+#include <cstdlib>
+
+using namespace std;
+
+// ===================== Helpers =====================
+const size_t width = 1024;
+
+bool allEqual(const xt::xarray<double>& grad, double expected, const char* name) {
+    for (size_t i = 0; i < grad.size(); ++i) {
+        if (grad.data()[i] != expected) {
+            cerr << name << "[" << i << "] = " << grad.data()[i] << ", expected " << expected
+                 << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// ===================== Driver =====================
+int main(int argc, char** argv) {
+    const size_t threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4;
+    const size_t iterations = argc > 2 ? strtoul(argv[2], nullptr, 10) : 50;
+    const size_t rounds = argc > 3 ? strtoul(argv[3], nullptr, 10) : 8;
+    const size_t poolThreads = argc > 4 ? strtoul(argv[4], nullptr, 10) : 4;
+
+    // Workers make the engine run the two branches of each graph in
+    // parallel and split the elementwise loops, on top of the passes
+    // already running side by side.
+    threadPool::setThreadCount(poolThreads);
+    threadPool::setParallelThreshold(256);
+
+    const double w0 = 0.5;
+    const double b0 = 0.25;
+    auto w = filled({width}, w0);
+    auto b = filled({width}, b0);
+
+    bool ok = true;
+    for (size_t round = 0; round < rounds; ++round) {
+        auto fresh = filled({width}, 0.125);
+        vector<tensor> inputs;
+        for (size_t t = 0; t < threads; ++t) {
+            inputs.push_back(filled({width}, double(t + 1)));
+        }
+
+        // out = (w * x + fresh) * w + b * w, so
+        //   dw = 2 * w * x + fresh + b, db = w, dfresh = w, dx = w * w.
+        // The threads wait at a gate so their first uses of fresh overlap.
+        atomic<size_t> arrived{0};
+        vector<thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                const tensor& x = inputs[t];
+                arrived.fetch_add(1);
+                while (arrived.load() < threads) {
+                    this_thread::yield();
+                }
+                for (size_t i = 0; i < iterations; ++i) {
+                    auto out = (w * x + fresh) * w + b * w;
+                    out->backward();
+                }
+            });
+        }
+        for (auto& th : workers) {
+            th.join();
+        }
+
+        const double n = double(iterations);
+        ok &= allEqual(fresh->getGrad(), threads * n * w0, "fresh");
+        for (size_t t = 0; t < threads; ++t) {
+            ok &= allEqual(inputs[t]->getGrad(), n * w0 * w0, "x");
+        }
+    }
+
+    // sum over threads of (2 * w0 * (t + 1) + 0.125 + b0), every iteration
+    // of every round.
+    double perPass = 0.0;
+    for (size_t t = 0; t < threads; ++t) {
+        perPass += 2 * w0 * double(t + 1) + 0.125 + b0;
+    }
+    const double passes = double(iterations * rounds);
+    ok &= allEqual(w->getGrad(), passes * perPass, "w");
+    ok &= allEqual(b->getGrad(), passes * threads * w0, "b");
+
+    cout << (ok ? "ok" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}